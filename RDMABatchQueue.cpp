@@ -0,0 +1,111 @@
+#include "RDMABatchQueue.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+
+using namespace std;
+using namespace rdma;
+
+void RDMABatchQueue::prepareSend(RDMAMessageBuffer &buffer, const uint8_t *data, size_t length, uint64_t userData) {
+    preparedSends.push_back({&buffer, const_cast<uint8_t *>(data), length, userData});
+}
+
+void RDMABatchQueue::prepareReceive(RDMAMessageBuffer &buffer, void *whereTo, size_t maxSize, uint64_t userData) {
+    preparedReceives.push_back({&buffer, static_cast<uint8_t *>(whereTo), maxSize, userData});
+}
+
+size_t RDMABatchQueue::submit() {
+    const size_t submitted = preparedSends.size() + preparedReceives.size();
+
+    // Staging stops at the first message, which doesn't fit, so check all of them before staging any
+    for (const auto &send : preparedSends) {
+        if (send.length > send.buffer->maxStageSize()) {
+            preparedSends.clear();
+            preparedReceives.clear();
+            throw runtime_error{"data > buffersize!"};
+        }
+    }
+
+    // Stage all messages first, then each connection writes its part of the batch at once
+    vector<RDMAMessageBuffer *> staged;
+    vector<RDMAMessageBuffer *> broken;
+    for (const auto &send : preparedSends) {
+        if (find(broken.begin(), broken.end(), send.buffer) != broken.end()) {
+            completions.push_back({send.userData, -EIO});
+            continue;
+        }
+        try {
+            send.buffer->stage(send.data, send.length);
+            completions.push_back({send.userData, static_cast<ssize_t>(send.length)});
+        } catch (const NetworkException &) {
+            broken.push_back(send.buffer);
+            completions.push_back({send.userData, -EIO});
+            continue;
+        }
+        if (find(staged.begin(), staged.end(), send.buffer) == staged.end()) {
+            staged.push_back(send.buffer);
+        }
+    }
+    for (auto buffer : staged) {
+        try {
+            buffer->flush();
+        } catch (const NetworkException &) {
+            // The staged messages are sent again by fallBackToTcp(), so they aren't lost
+        }
+    }
+    preparedSends.clear();
+
+    receives.insert(receives.end(), preparedReceives.begin(), preparedReceives.end());
+    preparedReceives.clear();
+    completeReceives();
+    return submitted;
+}
+
+size_t RDMABatchQueue::reap(Completion *results, size_t maxCompletions, size_t minCompletions, int timeoutMs) {
+    const auto start = chrono::steady_clock::now();
+    completeReceives();
+    while (completions.size() < minCompletions && not receives.empty()) {
+        if (timeoutMs >= 0 && chrono::steady_clock::now() - start >= chrono::milliseconds(timeoutMs)) {
+            break;
+        }
+        completeReceives();
+    }
+
+    const size_t reaped = min(maxCompletions, completions.size());
+    copy(completions.begin(), completions.begin() + reaped, results);
+    completions.erase(completions.begin(), completions.begin() + reaped);
+    return reaped;
+}
+
+size_t RDMABatchQueue::pendingReceives() const {
+    return receives.size();
+}
+
+void RDMABatchQueue::completeReceives() {
+    // A later receive of a buffer must not overtake an earlier one, which is still waiting
+    vector<RDMAMessageBuffer *> waiting;
+    for (auto receive = receives.begin(); receive != receives.end();) {
+        auto buffer = receive->buffer;
+        if (find(waiting.begin(), waiting.end(), buffer) != waiting.end()) {
+            ++receive;
+            continue;
+        }
+        ssize_t result;
+        try {
+            // Checks the connection as well, since there might never come anything
+            buffer->checkConnection();
+            if (not buffer->hasData()) {
+                waiting.push_back(buffer);
+                ++receive;
+                continue;
+            }
+            size_t received;
+            result = buffer->receiveOrSkip(receive->data, receive->length, received) ? static_cast<ssize_t>(received)
+                                                                                      : -EMSGSIZE;
+        } catch (const NetworkException &) {
+            result = -EIO;
+        }
+        completions.push_back({receive->userData, result});
+        receive = receives.erase(receive);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef RDMA_HASH_MAP_RDMABATCHQUEUE_H
+#define RDMA_HASH_MAP_RDMABATCHQUEUE_H
+
+#include <deque>
+#include <vector>
+#include <sys/types.h>
+#include "RDMAMessageBuffer.h"
+
+/// Submission / completion queue interface for many RDMAMessageBuffers, modeled on io_uring. Sends and receives for
+/// any number of connections are prepared first and then submitted together. All messages sent to one connection in a
+/// batch are written with a single work request, receives complete, as soon as their message is there. The results
+/// are reaped in batches, so a server handles many messages without a call per message.
+class RDMABatchQueue {
+public:
+    struct Completion {
+        /// The value given when preparing the operation
+        uint64_t userData;
+        /// The number of bytes sent / received, 0 for a receive at the end of the stream,
+        /// -EMSGSIZE for a receive, whose message was bigger than maxSize (the message is skipped),
+        /// or -EIO if the connection broke (see RDMAMessageBuffer::fallBackToTcp())
+        ssize_t result;
+    };
+
+    /// Queue a message for sending. data must stay valid until the next submit()
+    void prepareSend(RDMAMessageBuffer &buffer, const uint8_t *data, size_t length, uint64_t userData);
+
+    /// Queue receiving the next message of the buffer to a memory region of at least maxSize.
+    /// Receives of the same buffer complete in the order they were prepared
+    void prepareReceive(RDMAMessageBuffer &buffer, void *whereTo, size_t maxSize, uint64_t userData);
+
+    /// Send all prepared messages and start waiting for the prepared receives. Returns the number of submitted operations.
+    /// Throws, without submitting any of the prepared operations, if a message doesn't fit into the ring of its buffer
+    size_t submit();
+
+    /// Get up to maxCompletions results, waiting until at least minCompletions are available or timeoutMs expired
+    /// (-1 waits without a timeout). Receives on broken connections complete with -EIO while waiting
+    size_t reap(Completion *completions, size_t maxCompletions, size_t minCompletions = 0, int timeoutMs = -1);
+
+    /// Number of submitted receives, which haven't completed yet
+    size_t pendingReceives() const;
+
+private:
+    struct Submission {
+        RDMAMessageBuffer *buffer;
+        uint8_t *data;
+        size_t length;
+        uint64_t userData;
+    };
+
+    std::vector<Submission> preparedSends;
+    std::vector<Submission> preparedReceives;
+    std::deque<Submission> receives;
+    std::deque<Completion> completions;
+
+    /// Complete all receives, whose messages are there, without blocking
+    void completeReceives();
+};
+
+#endif //RDMA_HASH_MAP_RDMABATCHQUEUE_H
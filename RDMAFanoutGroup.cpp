@@ -0,0 +1,78 @@
+#include "RDMAFanoutGroup.h"
+#include "rdma/WorkRequest.hpp"
+#include "wraparound.h"
+
+using namespace std;
+using namespace rdma;
+
+RDMAFanoutGroup::RDMAFanoutGroup(size_t size, const vector<int> &socks) :
+        size(size),
+        sendBuffer(make_unique<uint8_t[]>(size)),
+        localSend(sendBuffer.get(), size, network.getProtectionDomain(), MemoryRegion::Permission::None) {
+    const bool powerOfTwo = (size != 0) && !(size & (size - 1));
+    if (not powerOfTwo) {
+        throw runtime_error{"size should be a power of 2"};
+    }
+
+    // All peers live in the same network, so they can all write from our send buffer
+    for (auto sock : socks) {
+        peers.push_back(unique_ptr<RDMAMessageBuffer>(new RDMAMessageBuffer(size, sock, 1, &network, 0, true)));
+    }
+}
+
+void RDMAFanoutGroup::send(const uint8_t *data, size_t length) {
+    send(data, length, true);
+}
+
+void RDMAFanoutGroup::send(const uint8_t *data, size_t length, bool inln) {
+    const size_t sizeToWrite = sizeof(length) + length + sizeof(RDMAMessageBuffer::validity);
+    if (sizeToWrite > size) throw runtime_error{"data > buffersize!"};
+
+    // Flow control is tracked per peer, so the slowest peer limits the whole group
+    for (auto &peer : peers) {
+        peer->waitForSendSpace(sizeToWrite);
+    }
+
+    const size_t startOfWrite = sendPos;
+
+    writeToSendBuffer(reinterpret_cast<const uint8_t *>(&length), sizeof(length));
+    writeToSendBuffer(data, length);
+    writeToSendBuffer(reinterpret_cast<const uint8_t *>(&RDMAMessageBuffer::validity),
+                      sizeof(RDMAMessageBuffer::validity));
+
+    // All rings have the same size and position, so every peer gets the same slices
+    for (auto &peer : peers) {
+        WriteWorkRequest writes[2];
+        size_t writeCount = 0;
+        wraparound(size, sizeToWrite, startOfWrite, [&](auto, auto beginPos, auto endPos) {
+            const auto sendSlice = localSend.slice(beginPos, endPos - beginPos);
+            auto &write = writes[writeCount++];
+            write.setLocalAddress(sendSlice);
+            write.setRemoteAddress(peer->remoteReceive.slice(beginPos));
+            write.setSendInline(inln && sendSlice.size <= peer->net.queuePair.getMaxInlineSize());
+        });
+        if (writeCount == 2) {
+            writes[0].setNextWorkRequest(&writes[1]);
+        }
+        // Post both parts of a wrapped message with a single doorbell
+        peer->net.queuePair.postWorkRequest(writes[0]);
+        peer->sendPos += sizeToWrite;
+        peer->flushedPos = peer->sendPos;
+    }
+}
+
+RDMAMessageBuffer &RDMAFanoutGroup::peer(size_t index) {
+    return *peers.at(index);
+}
+
+size_t RDMAFanoutGroup::peerCount() const {
+    return peers.size();
+}
+
+void RDMAFanoutGroup::writeToSendBuffer(const uint8_t *data, size_t sizeToWrite) {
+    wraparound(sendBuffer.get(), size, sizeToWrite, sendPos, [&](auto prevBytes, auto begin, auto end) {
+        copy(data + prevBytes, data + prevBytes + distance(begin, end), begin);
+    });
+
+    sendPos += sizeToWrite;
+}
@@ -0,0 +1,38 @@
+#ifndef RDMA_HASH_MAP_RDMAFANOUTGROUP_H
+#define RDMA_HASH_MAP_RDMAFANOUTGROUP_H
+
+#include <vector>
+#include "RDMAMessageBuffer.h"
+
+/// Sends the same messages to multiple peers, e.g. for replication. A message is staged only once in a shared
+/// registered buffer, from which it is written to the rings of all peers. The peers use a usual RDMAMessageBuffer.
+class RDMAFanoutGroup {
+public:
+
+    /// Send data to all peers
+    void send(const uint8_t *data, size_t length);
+
+    void send(const uint8_t *data, size_t length, bool inln);
+
+    /// The connection to a single peer, e.g. to receive its answers. It is receive only: it has no send ring of its own,
+    /// only the group's buffer holds the messages, so sending, unreceivedBytes() and fallBackToTcp() throw.
+    RDMAMessageBuffer &peer(size_t index);
+
+    size_t peerCount() const;
+
+    /// Construct a group with message buffers of the given size to each of the peers behind the given sockets
+    /// size _must_ be a power of 2.
+    RDMAFanoutGroup(size_t size, const std::vector<int> &socks);
+
+private:
+    const size_t size;
+    rdma::Network network;
+    std::unique_ptr<uint8_t[]> sendBuffer;
+    size_t sendPos = 0;
+    rdma::MemoryRegion localSend;
+    std::vector<std::unique_ptr<RDMAMessageBuffer>> peers;
+
+    void writeToSendBuffer(const uint8_t *data, size_t sizeToWrite);
+};
+
+#endif //RDMA_HASH_MAP_RDMAFANOUTGROUP_H
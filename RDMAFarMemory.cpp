@@ -0,0 +1,233 @@
+#include "RDMAFarMemory.h"
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include "rdma/WorkRequest.hpp"
+#include "tcpWrapper.h"
+
+using namespace std;
+using namespace rdma;
+
+static const uint64_t transferId = 1;
+static const uint64_t allocateId = 2;
+/// Transfers posted at once, well below the depth of the send queue
+static const size_t maxTransfers = 4096;
+
+struct PoolInfo {
+    uint32_t arenaKey;
+    uint32_t nextPageKey;
+    uintptr_t arenaAddress;
+    uintptr_t nextPageAddress;
+    uint64_t pageSize;
+    uint64_t pageCount;
+};
+
+/// Reserve the arena without touching it, unlike allocatePages(), so untouched pages stay unused with on-demand paging
+static uint8_t *mapArena(size_t size) {
+    if (size == 0) throw runtime_error{"the pool needs at least one page"};
+    auto arena = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) {
+        throw bad_alloc();
+    }
+    return static_cast<uint8_t *>(arena);
+}
+
+void RDMAMemoryPool::ArenaDeleter::operator()(uint8_t *arena) const {
+    munmap(arena, size);
+}
+
+RDMAMemoryPool::RDMAMemoryPool(size_t pageCount, size_t pageSize) :
+        pageCount(pageCount),
+        pageSize(pageSize),
+        arena(mapArena(pageCount * pageSize), ArenaDeleter{pageCount * pageSize}),
+        nextPage(static_cast<uint64_t *>(allocatePages(sizeof(uint64_t)))),
+        localArena(arena.get(), pageCount * pageSize, network.getProtectionDomain(),
+                   MemoryRegion::Permission::LocalWrite | MemoryRegion::Permission::RemoteWrite |
+                   MemoryRegion::Permission::RemoteRead | MemoryRegion::Permission::OnDemand),
+        localNextPage(nextPage.get(), sizeof(uint64_t), network.getProtectionDomain(),
+                      MemoryRegion::Permission::LocalWrite | MemoryRegion::Permission::RemoteRead |
+                      MemoryRegion::Permission::RemoteAtomic) {}
+
+void RDMAMemoryPool::accept(int sock) {
+    clients.push_back(make_unique<RDMANetworking>(sock, 1, &network));
+
+    PoolInfo info{};
+    info.arenaKey = localArena.key->rkey;
+    info.arenaAddress = reinterpret_cast<uintptr_t>(localArena.address);
+    info.nextPageKey = localNextPage.key->rkey;
+    info.nextPageAddress = reinterpret_cast<uintptr_t>(localNextPage.address);
+    info.pageSize = pageSize;
+    info.pageCount = pageCount;
+    tcp_write(sock, &info, sizeof(info));
+}
+
+uint64_t RDMAMemoryPool::allocatedPages() const {
+    // Failed allocations increment the counter beyond the end of the arena as well
+    const uint64_t handedOut = *reinterpret_cast<volatile uint64_t *>(nextPage.get());
+    return min<uint64_t>(handedOut, pageCount);
+}
+
+RDMAFarMemory::RDMAFarMemory(int sock, size_t cachePages) :
+        net(sock),
+        cachePages(cachePages) {
+    if (cachePages == 0) throw runtime_error{"the cache needs at least one page"};
+
+    PoolInfo info{};
+    tcp_read(sock, &info, sizeof(info));
+    pageSize = info.pageSize;
+    pageCount = info.pageCount;
+    remoteArena = RemoteMemoryRegion(info.arenaAddress, info.arenaKey);
+    remoteNextPage = RemoteMemoryRegion(info.nextPageAddress, info.nextPageKey);
+
+    const size_t cacheSize = cachePages * pageSize + sizeof(uint64_t);
+    cache = unique_ptr<uint8_t[], PageDeleter>(static_cast<uint8_t *>(allocatePages(cacheSize)));
+    localCache = make_unique<MemoryRegion>(cache.get(), cacheSize, net.network.getProtectionDomain(),
+                                           MemoryRegion::Permission::LocalWrite);
+    frames.resize(cachePages);
+    for (size_t frame = cachePages; frame > 0; --frame) {
+        freeFrames.push_back(frame - 1);
+    }
+}
+
+RDMAFarMemory::~RDMAFarMemory() {
+    try {
+        flush();
+    } catch (const NetworkException &) {
+        // The pool is gone, so are the pages
+    }
+}
+
+uint64_t RDMAFarMemory::allocate() {
+    if (not freePages.empty()) {
+        const auto page = freePages.back();
+        freePages.pop_back();
+        freedPages.erase(page);
+        return page;
+    }
+
+    const auto resultOffset = cachePages * pageSize;
+    auto fetchAndAdd = AtomicFetchAndAddWorkRequestBuilder(localCache->slice(resultOffset, sizeof(uint64_t)),
+                                                           remoteNextPage, 1, true).build();
+    fetchAndAdd.setId(allocateId);
+    net.queuePair.postWorkRequest(fetchAndAdd);
+    while (net.completionQueue.pollSendCompletionQueue() != allocateId);
+
+    uint64_t page;
+    memcpy(&page, cache.get() + resultOffset, sizeof(page));
+    if (page >= pageCount) throw runtime_error{"the memory pool is exhausted"};
+    return page;
+}
+
+void RDMAFarMemory::free(uint64_t page) {
+    if (page >= pageCount) throw runtime_error{"no such page"};
+    if (not freedPages.insert(page).second) throw runtime_error{"page freed twice"};
+
+    auto it = cached.find(page);
+    if (it != cached.end()) {
+        freeFrames.push_back(*it->second);
+        lru.erase(it->second);
+        cached.erase(it);
+    }
+    freePages.push_back(page);
+}
+
+const uint8_t *RDMAFarMemory::read(uint64_t page) {
+    return frameData(access(page));
+}
+
+uint8_t *RDMAFarMemory::write(uint64_t page) {
+    const auto frame = access(page);
+    frames[frame].dirty = true;
+    return frameData(frame);
+}
+
+void RDMAFarMemory::flush() {
+    vector<size_t> dirtyFrames;
+    for (auto frame : lru) {
+        if (frames[frame].dirty) {
+            dirtyFrames.push_back(frame);
+        }
+    }
+    // Pages stay dirty until their write completed, so a failed flush can be repeated
+    for (size_t begin = 0; begin < dirtyFrames.size(); begin += maxTransfers) {
+        const auto end = min(begin + maxTransfers, dirtyFrames.size());
+        const vector<size_t> chunk(dirtyFrames.begin() + begin, dirtyFrames.begin() + end);
+        transfer(chunk, true);
+        for (auto frame : chunk) {
+            frames[frame].dirty = false;
+        }
+    }
+}
+
+size_t RDMAFarMemory::access(uint64_t page) {
+    if (page >= pageCount) throw runtime_error{"no such page"};
+
+    auto it = cached.find(page);
+    if (it != cached.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        return *it->second;
+    }
+
+    size_t frame;
+    if (freeFrames.empty()) {
+        frame = evict();
+    } else {
+        frame = freeFrames.back();
+        freeFrames.pop_back();
+    }
+    frames[frame] = {page, false};
+    try {
+        transfer({frame}, false);
+    } catch (...) {
+        // The frame isn't in the LRU list yet, so it would be lost otherwise
+        freeFrames.push_back(frame);
+        throw;
+    }
+    lru.push_front(frame);
+    cached[page] = lru.begin();
+    return frame;
+}
+
+size_t RDMAFarMemory::evict() {
+    const auto frame = lru.back();
+    if (frames[frame].dirty) {
+        transfer({frame}, true);
+    }
+    cached.erase(frames[frame].page);
+    lru.pop_back();
+    return frame;
+}
+
+uint8_t *RDMAFarMemory::frameData(size_t frame) {
+    return cache.get() + frame * pageSize;
+}
+
+void RDMAFarMemory::transfer(const vector<size_t> &transferFrames, bool toPool) {
+    if (toPool) {
+        postTransfers<WriteWorkRequest>(transferFrames);
+    } else {
+        postTransfers<ReadWorkRequest>(transferFrames);
+    }
+}
+
+template<typename Request>
+void RDMAFarMemory::postTransfers(const vector<size_t> &transferFrames) {
+    if (transferFrames.empty()) {
+        return;
+    }
+
+    vector<Request> requests(transferFrames.size());
+    for (size_t i = 0; i < transferFrames.size(); ++i) {
+        const auto frame = transferFrames[i];
+        requests[i].setLocalAddress(localCache->slice(frame * pageSize, pageSize));
+        requests[i].setRemoteAddress(remoteArena.slice(frames[frame].page * pageSize));
+        if (i != 0) {
+            requests[i - 1].setNextWorkRequest(&requests[i]);
+        }
+    }
+    // Work requests complete in order, so only the last one needs to be signaled
+    requests.back().setCompletion(true);
+    requests.back().setId(transferId);
+    net.queuePair.postWorkRequest(requests.front());
+    while (net.completionQueue.pollSendCompletionQueue() != transferId);
+}
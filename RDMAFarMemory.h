@@ -0,0 +1,107 @@
+#ifndef RDMA_HASH_MAP_RDMAFARMEMORY_H
+#define RDMA_HASH_MAP_RDMAFARMEMORY_H
+
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "RDMAMessageBuffer.h"
+
+/// A big arena of fixed size pages in registered memory, which clients (RDMAFarMemory) allocate, read and write with
+/// one-sided RDMA only, e.g. to spill state to the memory of a neighbor instead of to disk.
+/// The arena is registered with on-demand paging if the device supports it, so only pages in use occupy memory.
+class RDMAMemoryPool {
+public:
+    RDMAMemoryPool(size_t pageCount, size_t pageSize = 4096);
+
+    /// Connect a client (RDMAFarMemory) over the given socket
+    void accept(int sock);
+
+    /// How many pages have been handed out to clients so far
+    uint64_t allocatedPages() const;
+
+private:
+    const size_t pageCount;
+    const size_t pageSize;
+    rdma::Network network;
+    /// Unmaps the arena
+    struct ArenaDeleter {
+        size_t size;
+
+        void operator()(uint8_t *arena) const;
+    };
+
+    std::unique_ptr<uint8_t[], ArenaDeleter> arena;
+    /// Pages are handed out with remote fetch and adds on this counter
+    std::unique_ptr<uint64_t, PageDeleter> nextPage;
+    rdma::MemoryRegion localArena;
+    rdma::MemoryRegion localNextPage;
+    std::vector<std::unique_ptr<RDMANetworking>> clients;
+};
+
+/// Client of an RDMAMemoryPool with a local write back cache of the most recently used pages.
+/// Pointers to cached pages stay valid until the next read() or write(), which might evict them.
+class RDMAFarMemory {
+public:
+    /// Connect to the pool, whose server called RDMAMemoryPool::accept() for the same socket. Up to cachePages pages
+    /// are kept locally
+    RDMAFarMemory(int sock, size_t cachePages);
+
+    ~RDMAFarMemory();
+
+    /// Allocate a page, reusing pages freed by this client first
+    uint64_t allocate();
+
+    /// Free a page, its contents are lost. Freeing a page twice throws
+    void free(uint64_t page);
+
+    /// Access a page for reading, fetching it from the pool if it isn't cached
+    const uint8_t *read(uint64_t page);
+
+    /// Access a page for writing. It is written back to the pool, when it is evicted or on flush()
+    uint8_t *write(uint64_t page);
+
+    /// Write all modified pages back to the pool
+    void flush();
+
+    size_t getPageSize() const { return pageSize; }
+
+private:
+    struct Frame {
+        uint64_t page;
+        bool dirty;
+    };
+
+    RDMANetworking net;
+    size_t pageSize = 0;
+    size_t pageCount = 0;
+    const size_t cachePages;
+    rdma::RemoteMemoryRegion remoteArena;
+    rdma::RemoteMemoryRegion remoteNextPage;
+    /// Registered memory for the cached pages, followed by the result of the fetch and adds
+    std::unique_ptr<uint8_t[], PageDeleter> cache;
+    std::unique_ptr<rdma::MemoryRegion> localCache;
+    std::vector<Frame> frames;
+    /// Cached frames, the most recently used one first
+    std::list<size_t> lru;
+    std::unordered_map<uint64_t, std::list<size_t>::iterator> cached;
+    std::vector<size_t> freeFrames;
+    std::vector<uint64_t> freePages;
+    /// The same pages as freePages, to detect double frees
+    std::unordered_set<uint64_t> freedPages;
+
+    /// The frame of the page, fetching it if needed, moved to the front of the LRU list
+    size_t access(uint64_t page);
+
+    size_t evict();
+
+    uint8_t *frameData(size_t frame);
+
+    /// Post the transfers between the frames and their pages at once and wait for them. The send queue has to fit them
+    void transfer(const std::vector<size_t> &transferFrames, bool toPool);
+
+    template<typename Request>
+    void postTransfers(const std::vector<size_t> &transferFrames);
+};
+
+#endif //RDMA_HASH_MAP_RDMAFARMEMORY_H
@@ -0,0 +1,248 @@
+#include "RDMAHashMap.h"
+#include <cstddef>
+#include <cstring>
+#include "rdma/WorkRequest.hpp"
+#include "tcpWrapper.h"
+
+using namespace std;
+using namespace rdma;
+
+static const uint64_t windowReadId = 1;
+static const uint64_t compareAndSwapId = 2;
+static const uint64_t unlockId = 3;
+
+struct HashTableInfo {
+    uint32_t key;
+    uintptr_t address;
+    uint64_t slotCount;
+};
+
+static_assert(sizeof(RDMAHashSlot) == 64, "a slot should fill exactly one cache line");
+
+static bool isStable(const RDMAHashSlot &slot) {
+    return slot.version % 2 == 0 && slot.version == slot.checkVersion;
+}
+
+RDMAHashTable::RDMAHashTable(size_t slotCount) :
+        slotCount(slotCount),
+        // The neighborhoods of the last slots continue after them, instead of wrapping around
+        slots(static_cast<RDMAHashSlot *>(allocatePages((slotCount + neighborhood - 1) * sizeof(RDMAHashSlot)))),
+        localSlots(slots.get(), (slotCount + neighborhood - 1) * sizeof(RDMAHashSlot), network.getProtectionDomain(),
+                   MemoryRegion::Permission::LocalWrite | MemoryRegion::Permission::RemoteWrite |
+                   MemoryRegion::Permission::RemoteRead | MemoryRegion::Permission::RemoteAtomic) {
+    if (slotCount == 0) {
+        throw runtime_error{"the table needs at least one slot"};
+    }
+}
+
+void RDMAHashTable::accept(int sock) {
+    clients.push_back(make_unique<RDMANetworking>(sock, 1, &network));
+
+    HashTableInfo info{};
+    info.key = localSlots.key->rkey;
+    info.address = reinterpret_cast<uintptr_t>(localSlots.address);
+    info.slotCount = slotCount;
+    tcp_write(sock, &info, sizeof(info));
+}
+
+RDMAHashMap::RDMAHashMap(int sock) :
+        net(sock),
+        buffers(new(allocatePages(sizeof(Buffers))) Buffers()),
+        localBuffers(buffers.get(), sizeof(Buffers), net.network.getProtectionDomain(),
+                     MemoryRegion::Permission::LocalWrite) {
+    HashTableInfo info{};
+    tcp_read(sock, &info, sizeof(info));
+    remoteSlots = RemoteMemoryRegion(info.address, info.key);
+    slotCount = info.slotCount;
+}
+
+bool RDMAHashMap::lookup(uint64_t key, vector<uint8_t> &value) {
+    if (key == 0) throw runtime_error{"key 0 marks empty slots"};
+
+    for (;;) {
+        readWindow(key);
+        bool torn = false;
+        for (const auto &slot : buffers->window) {
+            if (slot.key != key) {
+                continue;
+            }
+            // A writer changed the slot while we read it
+            if (not isStable(slot)) {
+                torn = true;
+                break;
+            }
+            value.assign(slot.value, slot.value + slot.length);
+            return true;
+        }
+        if (not torn) {
+            return false;
+        }
+    }
+}
+
+bool RDMAHashMap::insert(uint64_t key, const uint8_t *value, size_t length) {
+    if (key == 0) throw runtime_error{"key 0 marks empty slots"};
+    if (length > RDMAHashSlot::maxValueSize) throw runtime_error{"value too big for a slot"};
+
+    const size_t homeSlot = home(key);
+    for (;;) {
+        readWindow(key);
+        const auto &window = buffers->window;
+
+        // Update the value in place
+        size_t existing = RDMAHashTable::neighborhood;
+        bool torn = false;
+        for (size_t i = 0; i < RDMAHashTable::neighborhood; ++i) {
+            if (window[i].key == key) {
+                existing = i;
+                torn = not isStable(window[i]);
+            }
+        }
+        if (torn) {
+            continue;
+        }
+        if (existing != RDMAHashTable::neighborhood) {
+            if (lock(homeSlot + existing, window[existing].version)) {
+                writeAndUnlock(homeSlot + existing, window[existing].version, key, value, length);
+                return true;
+            }
+            continue;
+        }
+
+        // New keys are only inserted while holding the lock of the home slot, so the same key can't be inserted
+        // twice into different free slots of the neighborhood
+        if (not isStable(window[0]) || not lock(homeSlot, window[0].version)) {
+            continue;
+        }
+        const auto homeVersion = window[0].version;
+        if (window[0].key == 0) {
+            writeAndUnlock(homeSlot, homeVersion, key, value, length);
+            return true;
+        }
+
+        // Nobody can insert this key now, so it's enough to look for it again, together with the free slots
+        readWindow(key);
+        bool inserted = false;
+        bool retry = false;
+        for (size_t i = 1; i < RDMAHashTable::neighborhood; ++i) {
+            if (window[i].key == key || (window[i].key == 0 && not isStable(window[i]))) {
+                retry = true; // updated or erased concurrently
+                break;
+            }
+            if (window[i].key != 0) {
+                continue;
+            }
+            retry = not lock(homeSlot + i, window[i].version);
+            if (not retry) {
+                writeAndUnlock(homeSlot + i, window[i].version, key, value, length);
+                inserted = true;
+            }
+            break;
+        }
+        unlock(homeSlot, homeVersion, false);
+        if (not retry) {
+            return inserted;
+        }
+    }
+}
+
+bool RDMAHashMap::erase(uint64_t key) {
+    if (key == 0) throw runtime_error{"key 0 marks empty slots"};
+
+    const size_t homeSlot = home(key);
+    for (;;) {
+        readWindow(key);
+        const auto &window = buffers->window;
+        size_t existing = RDMAHashTable::neighborhood;
+        bool torn = false;
+        for (size_t i = 0; i < RDMAHashTable::neighborhood; ++i) {
+            if (window[i].key == key) {
+                existing = i;
+                torn = not isStable(window[i]);
+            }
+        }
+        if (existing == RDMAHashTable::neighborhood) {
+            return false;
+        }
+        if (not torn && lock(homeSlot + existing, window[existing].version)) {
+            writeAndUnlock(homeSlot + existing, window[existing].version, 0, nullptr, 0);
+            return true;
+        }
+    }
+}
+
+size_t RDMAHashMap::home(uint64_t key) const {
+    // Mix the bits (murmur3 finalizer), so consecutive keys don't crowd the same neighborhoods
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key % slotCount;
+}
+
+void RDMAHashMap::readWindow(uint64_t key) {
+    ReadWorkRequest read;
+    read.setLocalAddress(localBuffers.slice(offsetof(Buffers, window), sizeof(Buffers::window)));
+    read.setRemoteAddress(remoteSlots.slice(home(key) * sizeof(RDMAHashSlot)));
+    read.setCompletion(true);
+    read.setId(windowReadId);
+    net.queuePair.postWorkRequest(read);
+    waitFor(windowReadId);
+}
+
+bool RDMAHashMap::lock(size_t slot, uint64_t version) {
+    auto compareAndSwap = AtomicCompareAndSwapWorkRequestBuilder(
+            localBuffers.slice(offsetof(Buffers, previousVersion), sizeof(uint64_t)),
+            remoteSlots.slice(slot * sizeof(RDMAHashSlot) + offsetof(RDMAHashSlot, version)), version, version + 1,
+            true).build();
+    compareAndSwap.setId(compareAndSwapId);
+    net.queuePair.postWorkRequest(compareAndSwap);
+    waitFor(compareAndSwapId);
+    return buffers->previousVersion == version;
+}
+
+void RDMAHashMap::unlock(size_t slot, uint64_t version, bool withUpdate) {
+    auto remoteSlot = remoteSlots.slice(slot * sizeof(RDMAHashSlot));
+    buffers->lockedVersion = version + 1;
+    buffers->update.checkVersion = version + 2;
+    buffers->unlockedVersion = version + 2;
+
+    // Readers compare checkVersion, which is written before the contents, with version, which is written last.
+    // All writes go over the same queue pair, so they are executed in this order
+    WriteWorkRequest markWrite;
+    markWrite.setLocalAddress(localBuffers.slice(offsetof(Buffers, lockedVersion), sizeof(uint64_t)));
+    markWrite.setRemoteAddress(remoteSlot.slice(offsetof(RDMAHashSlot, checkVersion)));
+
+    const size_t contentsBegin = withUpdate ? offsetof(RDMAHashSlot, key) : offsetof(RDMAHashSlot, checkVersion);
+    WriteWorkRequest contentsWrite;
+    contentsWrite.setLocalAddress(localBuffers.slice(offsetof(Buffers, update) + contentsBegin,
+                                                     sizeof(RDMAHashSlot) - contentsBegin));
+    contentsWrite.setRemoteAddress(remoteSlot.slice(contentsBegin));
+
+    WriteWorkRequest versionWrite;
+    versionWrite.setLocalAddress(localBuffers.slice(offsetof(Buffers, unlockedVersion), sizeof(uint64_t)));
+    versionWrite.setRemoteAddress(remoteSlot.slice(offsetof(RDMAHashSlot, version)));
+    versionWrite.setCompletion(true);
+    versionWrite.setId(unlockId);
+
+    markWrite.setNextWorkRequest(&contentsWrite);
+    contentsWrite.setNextWorkRequest(&versionWrite);
+    net.queuePair.postWorkRequest(withUpdate ? markWrite : contentsWrite);
+    waitFor(unlockId);
+}
+
+void RDMAHashMap::writeAndUnlock(size_t slot, uint64_t version, uint64_t key, const uint8_t *value, size_t length) {
+    auto &update = buffers->update;
+    update.key = key;
+    update.length = length;
+    memset(update.value, 0, sizeof(update.value));
+    if (length != 0) {
+        memcpy(update.value, value, length);
+    }
+    unlock(slot, version, true);
+}
+
+void RDMAHashMap::waitFor(uint64_t id) {
+    while (net.completionQueue.pollSendCompletionQueue() != id);
+}
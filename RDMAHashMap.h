@@ -0,0 +1,92 @@
+#ifndef RDMA_HASH_MAP_RDMAHASHMAP_H
+#define RDMA_HASH_MAP_RDMAHASHMAP_H
+
+#include <vector>
+#include "RDMAMessageBuffer.h"
+
+/// A slot of the hash table. The key and a small value are stored inline, so a lookup needs a single read.
+/// version is odd, while a client has locked the slot. Writers change checkVersion first and version last, so a slot
+/// has been read consistently, if both are equal and even.
+struct RDMAHashSlot {
+    static const size_t maxValueSize = 32;
+
+    uint64_t version;
+    /// 0 marks an empty slot
+    uint64_t key;
+    uint64_t length;
+    uint8_t value[maxValueSize];
+    uint64_t checkVersion;
+};
+
+/// Hash table in registered memory, which is accessed by its clients with one-sided RDMA only. So the CPU of the server
+/// isn't involved in any lookup or update, it only hands out the table to new clients.
+/// A key is stored in one of the slots of its neighborhood, the slots following its hash. A lookup reads the whole
+/// neighborhood at once, updates lock single slots with a compare and swap.
+class RDMAHashTable {
+public:
+    /// The number of slots, a key can be stored in
+    static const size_t neighborhood = 8;
+
+    explicit RDMAHashTable(size_t slotCount);
+
+    /// Connect a client (RDMAHashMap) over the given socket
+    void accept(int sock);
+
+private:
+    const size_t slotCount;
+    rdma::Network network;
+    std::unique_ptr<RDMAHashSlot[], PageDeleter> slots;
+    rdma::MemoryRegion localSlots;
+    std::vector<std::unique_ptr<RDMANetworking>> clients;
+};
+
+/// Client of an RDMAHashTable. Keys must not be 0, values can have up to RDMAHashSlot::maxValueSize bytes.
+/// A client, which dies while holding a lock, leaves the slot locked
+class RDMAHashMap {
+public:
+    /// Connect to the table, whose server called RDMAHashTable::accept() for the same socket
+    explicit RDMAHashMap(int sock);
+
+    /// Find the value of the key with a single read, returns false if it isn't there
+    bool lookup(uint64_t key, std::vector<uint8_t> &value);
+
+    /// Insert the key or update its value. Returns false, if all slots of its neighborhood are taken
+    bool insert(uint64_t key, const uint8_t *value, size_t length);
+
+    /// Remove the key, returns false if it isn't there
+    bool erase(uint64_t key);
+
+private:
+    /// Registered memory for the results of reads and compare and swaps and the sources of writes
+    struct Buffers {
+        RDMAHashSlot window[RDMAHashTable::neighborhood];
+        RDMAHashSlot update;
+        uint64_t previousVersion;
+        uint64_t lockedVersion;
+        uint64_t unlockedVersion;
+    };
+
+    RDMANetworking net;
+    size_t slotCount = 0;
+    rdma::RemoteMemoryRegion remoteSlots;
+    std::unique_ptr<Buffers, PageDeleter> buffers;
+    rdma::MemoryRegion localBuffers;
+
+    size_t home(uint64_t key) const;
+
+    /// Read the neighborhood of the key into the window
+    void readWindow(uint64_t key);
+
+    /// Try to lock the slot at the given version
+    bool lock(size_t slot, uint64_t version);
+
+    /// Unlock a slot locked at the given version. With withUpdate, the key and value in the update buffer are written
+    void unlock(size_t slot, uint64_t version, bool withUpdate);
+
+    /// Write the key and value to a slot locked at the given version and unlock it
+    void writeAndUnlock(size_t slot, uint64_t version, uint64_t key, const uint8_t *value, size_t length);
+
+    void waitFor(uint64_t id);
+};
+
+#endif //RDMA_HASH_MAP_RDMAHASHMAP_H
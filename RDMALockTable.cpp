@@ -0,0 +1,216 @@
+#include "RDMALockTable.h"
+#include <algorithm>
+#include <thread>
+#include "rdma/WorkRequest.hpp"
+#include "tcpWrapper.h"
+
+using namespace std;
+using namespace rdma;
+
+static const uint64_t compareAndSwapId = 1;
+static const unsigned ownerShift = 48;
+static const uint64_t sequenceMask = (uint64_t(1) << ownerShift) - 1;
+static const chrono::microseconds minBackoff(1);
+static const chrono::microseconds maxBackoff(1000);
+
+struct LockTableInfo {
+    uint32_t key;
+    uintptr_t address;
+    uint64_t lockCount;
+    uint64_t clientId;
+};
+
+RDMALockTable::RDMALockTable(size_t lockCount) :
+        lockCount(lockCount),
+        locks(static_cast<uint64_t *>(allocatePages(lockCount * sizeof(uint64_t)))),
+        localLocks(locks.get(), lockCount * sizeof(uint64_t), network.getProtectionDomain(),
+                   MemoryRegion::Permission::LocalWrite | MemoryRegion::Permission::RemoteRead |
+                   MemoryRegion::Permission::RemoteAtomic) {
+    if (lockCount == 0) {
+        throw runtime_error{"the table needs at least one lock"};
+    }
+    fill(locks.get(), locks.get() + lockCount, 0);
+}
+
+void RDMALockTable::accept(int sock) {
+    // Client ids start with 1, so held locks never have the word 0
+    if (clientCount == UINT16_MAX) throw runtime_error{"too many clients"};
+    clients.push_back(make_unique<RDMANetworking>(sock, 1, &network));
+
+    LockTableInfo info{};
+    info.key = localLocks.key->rkey;
+    info.address = reinterpret_cast<uintptr_t>(localLocks.address);
+    info.lockCount = lockCount;
+    info.clientId = ++clientCount;
+    tcp_write(sock, &info, sizeof(info));
+}
+
+RDMALockClient::RDMALockClient(int sock, chrono::microseconds leaseTime) :
+        net(sock),
+        leaseTime(leaseTime) {
+    LockTableInfo info{};
+    tcp_read(sock, &info, sizeof(info));
+    remoteLocks = RemoteMemoryRegion(info.address, info.key);
+    lockCount = info.lockCount;
+    clientId = info.clientId;
+
+    previousWords = unique_ptr<uint64_t[], PageDeleter>(
+            static_cast<uint64_t *>(allocatePages(lockCount * sizeof(uint64_t))));
+    localPreviousWords = make_unique<MemoryRegion>(previousWords.get(), lockCount * sizeof(uint64_t),
+                                                   net.network.getProtectionDomain(),
+                                                   MemoryRegion::Permission::LocalWrite);
+}
+
+bool RDMALockClient::tryLock(size_t lock) {
+    return tryLockAll({lock})[0];
+}
+
+bool RDMALockClient::lock(size_t lock, chrono::microseconds timeout) {
+    return lockAll({lock}, timeout);
+}
+
+bool RDMALockClient::lockAll(vector<size_t> locks, chrono::microseconds timeout) {
+    sort(locks.begin(), locks.end());
+    locks.erase(unique(locks.begin(), locks.end()), locks.end());
+
+    const auto start = Clock::now();
+    auto backoff = minBackoff;
+    for (;;) {
+        const auto success = tryLockAll(locks);
+        if (all_of(success.begin(), success.end(), [](bool locked) { return locked; })) {
+            return true;
+        }
+
+        // Release the acquired locks again, instead of waiting for the others while holding them, which could deadlock
+        vector<size_t> acquiredLocks;
+        for (size_t i = 0; i < locks.size(); ++i) {
+            if (success[i]) {
+                acquiredLocks.push_back(locks[i]);
+            }
+        }
+        unlockAll(acquiredLocks);
+
+        if (Clock::now() - start + backoff > timeout) {
+            return false;
+        }
+        this_thread::sleep_for(backoff);
+        backoff = min(backoff * 2, maxBackoff);
+    }
+}
+
+bool RDMALockClient::renew(size_t lock) {
+    auto it = held.find(lock);
+    if (it == held.end()) throw runtime_error{"the lock isn't held"};
+
+    const auto attempt = Clock::now();
+    const auto renewed = ownWord();
+    compareAndSwap({lock}, {it->second.word}, {renewed});
+    if (previousWords[lock] != it->second.word) {
+        held.erase(it);
+        return false;
+    }
+    it->second = {renewed, attempt};
+    return true;
+}
+
+bool RDMALockClient::unlock(size_t lock) {
+    auto it = held.find(lock);
+    if (it == held.end()) throw runtime_error{"the lock isn't held"};
+
+    const auto word = it->second.word;
+    held.erase(it);
+    compareAndSwap({lock}, {word}, {0});
+    return previousWords[lock] == word;
+}
+
+void RDMALockClient::unlockAll(const vector<size_t> &locks) {
+    vector<size_t> heldLocks;
+    vector<uint64_t> words;
+    for (auto lock : locks) {
+        auto it = held.find(lock);
+        if (it != held.end()) {
+            heldLocks.push_back(lock);
+            words.push_back(it->second.word);
+            held.erase(it);
+        }
+    }
+    compareAndSwap(heldLocks, words, vector<uint64_t>(heldLocks.size(), 0));
+}
+
+bool RDMALockClient::holds(size_t lock) const {
+    auto it = held.find(lock);
+    return it != held.end() && Clock::now() - it->second.acquired < leaseTime;
+}
+
+uint64_t RDMALockClient::ownWord() {
+    return (clientId << ownerShift) | (nextSequence++ & sequenceMask);
+}
+
+void RDMALockClient::compareAndSwap(const vector<size_t> &locks, const vector<uint64_t> &compareValues,
+                                    const vector<uint64_t> &swapValues) {
+    if (locks.empty()) {
+        return;
+    }
+
+    vector<AtomicCompareAndSwapWorkRequest> requests;
+    requests.reserve(locks.size());
+    for (size_t i = 0; i < locks.size(); ++i) {
+        if (locks[i] >= lockCount) throw runtime_error{"no such lock"};
+        // Only the last one is signaled, the others are finished before it
+        requests.push_back(AtomicCompareAndSwapWorkRequestBuilder(
+                localPreviousWords->slice(locks[i] * sizeof(uint64_t), sizeof(uint64_t)),
+                remoteLocks.slice(locks[i] * sizeof(uint64_t)), compareValues[i], swapValues[i],
+                i + 1 == locks.size()).build());
+    }
+    for (size_t i = 0; i + 1 < requests.size(); ++i) {
+        requests[i].setNextWorkRequest(&requests[i + 1]);
+    }
+    requests.back().setId(compareAndSwapId);
+    net.queuePair.postWorkRequest(requests.front());
+    while (net.completionQueue.pollSendCompletionQueue() != compareAndSwapId);
+}
+
+uint64_t RDMALockClient::expectedWord(size_t lock, Clock::time_point now) const {
+    auto it = observed.find(lock);
+    if (it != observed.end() && it->second.word != 0 && now - it->second.since >= leaseTime) {
+        return it->second.word;
+    }
+    return 0;
+}
+
+bool RDMALockClient::acquired(size_t lock, uint64_t compareValue, uint64_t swapValue, Clock::time_point attempt) {
+    const auto previous = previousWords[lock];
+    if (previous == compareValue) {
+        // The lease started at the latest, when the compare and swap was posted
+        held[lock] = {swapValue, attempt};
+        observed.erase(lock);
+        return true;
+    }
+    auto &observation = observed[lock];
+    if (observation.word != previous) {
+        observation.word = previous;
+        observation.since = attempt;
+    }
+    return false;
+}
+
+vector<bool> RDMALockClient::tryLockAll(const vector<size_t> &locks) {
+    for (auto lock : locks) {
+        if (held.count(lock) != 0) throw runtime_error{"the lock is already held"};
+    }
+
+    const auto attempt = Clock::now();
+    vector<uint64_t> compareValues;
+    vector<uint64_t> swapValues;
+    for (auto lock : locks) {
+        compareValues.push_back(expectedWord(lock, attempt));
+        swapValues.push_back(ownWord());
+    }
+    compareAndSwap(locks, compareValues, swapValues);
+
+    vector<bool> success;
+    for (size_t i = 0; i < locks.size(); ++i) {
+        success.push_back(acquired(locks[i], compareValues[i], swapValues[i], attempt));
+    }
+    return success;
+}
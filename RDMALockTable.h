@@ -0,0 +1,98 @@
+#ifndef RDMA_HASH_MAP_RDMALOCKTABLE_H
+#define RDMA_HASH_MAP_RDMALOCKTABLE_H
+
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+#include "RDMAMessageBuffer.h"
+
+/// Lock words in registered memory, which clients (RDMALockClient) acquire and release with remote compare and swaps.
+/// A lock word is 0 while the lock is free, otherwise it holds the id of the owning client and a sequence number.
+class RDMALockTable {
+public:
+    explicit RDMALockTable(size_t lockCount);
+
+    /// Connect a client (RDMALockClient) over the given socket
+    void accept(int sock);
+
+private:
+    const size_t lockCount;
+    uint16_t clientCount = 0;
+    rdma::Network network;
+    std::unique_ptr<uint64_t[], PageDeleter> locks;
+    rdma::MemoryRegion localLocks;
+    std::vector<std::unique_ptr<RDMANetworking>> clients;
+};
+
+/// Client of an RDMALockTable. Locks are leases: a client only holds a lock for leaseTime after acquiring or renewing
+/// it. Waiting clients take over a lock, once its word didn't change for leaseTime, so a crashed client doesn't block
+/// others forever. This only relies on the clocks of all clients running at about the same rate, not on synchronized
+/// clocks.
+class RDMALockClient {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /// Connect to the lock table, whose server called RDMALockTable::accept() for the same socket
+    RDMALockClient(int sock, std::chrono::microseconds leaseTime);
+
+    /// Try to acquire the lock with a single compare and swap
+    bool tryLock(size_t lock);
+
+    /// Acquire the lock, retrying with exponential backoff until the timeout
+    bool lock(size_t lock, std::chrono::microseconds timeout);
+
+    /// Acquire all of the locks or none of them. Every attempt posts the compare and swaps of all missing locks at once
+    bool lockAll(std::vector<size_t> locks, std::chrono::microseconds timeout);
+
+    /// Extend the lease. Returns false, if the lock was taken over in the meantime
+    bool renew(size_t lock);
+
+    /// Release the lock. Returns false, if the lock was taken over in the meantime
+    bool unlock(size_t lock);
+
+    void unlockAll(const std::vector<size_t> &locks);
+
+    /// The lease of the lock hasn't expired yet
+    bool holds(size_t lock) const;
+
+private:
+    struct Held {
+        uint64_t word;
+        Clock::time_point acquired;
+    };
+
+    /// A foreign lock word and since when it hasn't changed
+    struct Observed {
+        uint64_t word = 0;
+        Clock::time_point since;
+    };
+
+    RDMANetworking net;
+    const std::chrono::microseconds leaseTime;
+    uint64_t clientId = 0;
+    uint64_t nextSequence = 0;
+    size_t lockCount = 0;
+    rdma::RemoteMemoryRegion remoteLocks;
+    /// Registered memory for the results of the compare and swaps, one per lock
+    std::unique_ptr<uint64_t[], PageDeleter> previousWords;
+    /// Registered once the number of locks is known
+    std::unique_ptr<rdma::MemoryRegion> localPreviousWords;
+    std::unordered_map<size_t, Held> held;
+    std::unordered_map<size_t, Observed> observed;
+
+    uint64_t ownWord();
+
+    /// Post the compare and swaps of all locks at once and wait for them
+    void compareAndSwap(const std::vector<size_t> &locks, const std::vector<uint64_t> &compareValues,
+                        const std::vector<uint64_t> &swapValues);
+
+    /// The word to compare against when acquiring: 0, or the word of an expired lease, which is taken over
+    uint64_t expectedWord(size_t lock, Clock::time_point now) const;
+
+    /// Record the result of an attempt to acquire the lock
+    bool acquired(size_t lock, uint64_t compareValue, uint64_t swapValue, Clock::time_point attempt);
+
+    std::vector<bool> tryLockAll(const std::vector<size_t> &locks);
+};
+
+#endif //RDMA_HASH_MAP_RDMALOCKTABLE_H
@@ -1,12 +1,29 @@
 #include "RDMAMessageBuffer.h"
+#include <cerrno>
 #include <iostream>
+#include <limits>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "rdma/WorkRequest.hpp"
 #include "tcpWrapper.h"
+#include "wraparound.h"
 
 using namespace std;
 using namespace rdma;
 
-static const size_t validity = 0xDEADDEADBEEFBEEF; // arbitrary constant. Just don't use 0
+const size_t RDMAMessageBuffer::validity = 0xDEADDEADBEEFBEEF; // arbitrary constant. Just don't use 0
+const size_t RDMAMessageBuffer::endOfStream = 0xC105EDC105EDC105; // different from validity and also not 0
+static const size_t moreFragmentsFlag = size_t(1) << (sizeof(size_t) * 8 - 1); // set in the size of non-last fragments
+static const size_t stripeThreshold = 64 * 1024; // smaller messages aren't worth striping
+static const size_t stripeSignalInterval = 4096;
+static const size_t maxStripes = 8; // keeps the signaled stripe writes well below the completion queue size
+static const auto closeTimeout = chrono::milliseconds(100); // don't let a dead remote side block close()
+static const auto remoteClosingTimeout = chrono::milliseconds(5); // a remote side, which still reads, answers quickly
+static const auto checkInterval = chrono::milliseconds(10);
+static const unsigned connectRetries = 3; // retransmits after the ack timeout, before the queue pair breaks
+static const uint64_t heartbeatId = 1;
+static const size_t emptyFrameSize = 2 * sizeof(size_t); // header and footer of a frame without data, e.g. endOfStream
 
 struct RmrInfo {
     uint32_t bufferKey;
@@ -33,61 +50,158 @@ static void sendRmrInfo(int sock, const MemoryRegion &buffer, const MemoryRegion
     tcp_write(sock, &rmrInfo, sizeof(rmrInfo));
 }
 
-static void exchangeQPNAndConnect(int sock, Network &network, QueuePair &queuePair) {
+static void exchangeQPNAndConnect(int sock, Network &network, QueuePair &queuePair, uint8_t serviceLevel) {
     Address addr{};
     addr.lid = network.getLID();
     addr.qpn = queuePair.getQPN();
     tcp_write(sock, &addr, sizeof(addr)); // Send own qpn to server
     tcp_read(sock, &addr, sizeof(addr)); // receive qpn
-    queuePair.connect(addr);
+    queuePair.connect(addr, connectRetries, serviceLevel);
     cout << "connected to qpn " << addr.qpn << " lid: " << addr.lid << endl;
 }
 
 vector<uint8_t> RDMAMessageBuffer::receive() {
-    size_t receiveSize = 0;
-    auto receiveValidity = static_cast<decltype(validity)>(0);
-    do {
-        readFromReceiveBuffer(readPos, reinterpret_cast<uint8_t *>(&receiveSize), sizeof(receiveSize));
-        readFromReceiveBuffer(readPos + sizeof(receiveSize) + receiveSize,
-                              reinterpret_cast<uint8_t *>(&receiveValidity), sizeof(receiveValidity));
-    } while (receiveValidity != validity);
+    vector<uint8_t> result;
+    bool moreFragments = true;
+    size_t receiveHeader;
+    // The end of the stream is never consumed, so all further receives return nothing as well
+    try {
+        while (moreFragments && waitForFragment(receiveHeader)) {
+            const size_t receiveSize = receiveHeader & ~moreFragmentsFlag;
+            moreFragments = (receiveHeader & moreFragmentsFlag) != 0;
 
-    auto result = vector<uint8_t>(receiveSize);
-    readFromReceiveBuffer(readPos + sizeof(receiveSize), result.data(), receiveSize);
-    zeroReceiveBuffer(readPos, sizeof(receiveSize) + receiveSize + sizeof(validity));
+            const auto alreadyReceived = result.size();
+            result.resize(alreadyReceived + receiveSize);
+            readFromReceiveBuffer(readPos + sizeof(receiveHeader), result.data() + alreadyReceived, receiveSize);
+            zeroReceiveBuffer(readPos, sizeof(receiveHeader) + receiveSize + sizeof(validity));
 
-    readPos += sizeof(receiveSize) + receiveSize + sizeof(validity);
+            readPos += sizeof(receiveHeader) + receiveSize + sizeof(validity);
+        }
+    } catch (const NetworkException &) {
+        // Already consumed fragments are gone from the ring, so hand them out. The sender keeps the rest of the
+        // message and sends it after fallBackToTcp()
+        if (result.empty()) {
+            throw;
+        }
+    }
 
     return result;
 }
 
 size_t RDMAMessageBuffer::receive(void *whereTo, size_t maxSize) {
-    size_t receiveSize = 0;
-    auto receiveValidity = static_cast<decltype(validity)>(0);
-    do {
-        readFromReceiveBuffer(readPos, reinterpret_cast<uint8_t *>(&receiveSize), sizeof(receiveSize));
-        readFromReceiveBuffer(readPos + sizeof(receiveSize) + receiveSize,
-                              reinterpret_cast<uint8_t *>(&receiveValidity),
-                              sizeof(receiveValidity));
-    } while (receiveValidity != validity);
+    bool skipped;
+    return receiveMessage(whereTo, maxSize, false, skipped);
+}
+
+bool RDMAMessageBuffer::receiveOrSkip(void *whereTo, size_t maxSize, size_t &received) {
+    bool skipped;
+    received = receiveMessage(whereTo, maxSize, true, skipped);
+    return not skipped;
+}
+
+size_t RDMAMessageBuffer::receiveMessage(void *whereTo, size_t maxSize, bool skipTooBig, bool &skipped) {
+    size_t alreadyReceived = 0;
+    bool moreFragments = true;
+    size_t receiveHeader;
+    skipped = false;
+    try {
+        while (moreFragments && waitForFragment(receiveHeader)) {
+            const size_t receiveSize = receiveHeader & ~moreFragmentsFlag;
+            moreFragments = (receiveHeader & moreFragmentsFlag) != 0;
+
+            if (alreadyReceived + receiveSize > maxSize) {
+                if (not skipTooBig) {
+                    throw runtime_error{"plz only read whole messages for now!"}; // probably buffer partially read msgs
+                }
+                // Striped messages might not fit into the ring as a whole, so their size is only known at the end
+                skipped = true;
+            }
+            if (not skipped) {
+                readFromReceiveBuffer(readPos + sizeof(receiveHeader),
+                                      reinterpret_cast<uint8_t *>(whereTo) + alreadyReceived, receiveSize);
+            }
+            zeroReceiveBuffer(readPos, sizeof(receiveHeader) + receiveSize + sizeof(validity));
+
+            readPos += sizeof(receiveHeader) + receiveSize + sizeof(validity);
+            alreadyReceived += receiveSize;
+        }
+    } catch (const NetworkException &) {
+        if (alreadyReceived == 0) {
+            throw;
+        }
+    }
+
+    return skipped ? 0 : alreadyReceived;
+}
 
-    if (receiveSize > maxSize) {
-        throw runtime_error{"plz only read whole messages for now!"}; // probably buffer partially read msgs
+bool RDMAMessageBuffer::peek(const uint8_t *&data, size_t &length) {
+    data = nullptr;
+    length = 0;
+    size_t receiveHeader;
+    if (not waitForFragment(receiveHeader)) {
+        return true;
+    }
+    const size_t receiveSize = receiveHeader & ~moreFragmentsFlag;
+    const size_t begin = (readPos + sizeof(receiveHeader)) % size;
+    if ((receiveHeader & moreFragmentsFlag) != 0 || begin + receiveSize > size) {
+        return false;
     }
-    readFromReceiveBuffer(readPos + sizeof(receiveSize), reinterpret_cast<uint8_t *>(whereTo), receiveSize);
-    zeroReceiveBuffer(readPos, sizeof(receiveSize) + receiveSize + sizeof(validity));
+    // The footer is valid, so the message has been written completely
+    data = const_cast<const uint8_t *>(receiveBuffer.get()) + begin;
+    length = receiveSize;
+    return true;
+}
 
-    readPos += sizeof(receiveSize) + receiveSize + sizeof(validity);
+void RDMAMessageBuffer::release() {
+    size_t receiveHeader;
+    if (peekFooter(readPos, receiveHeader) != validity) {
+        return; // the end of the stream is never consumed
+    }
+    const size_t frameSize = sizeof(receiveHeader) + (receiveHeader & ~moreFragmentsFlag) + sizeof(validity);
+    zeroReceiveBuffer(readPos, frameSize);
+    readPos += frameSize;
+}
 
-    return receiveSize;
+bool RDMAMessageBuffer::waitForFragment(size_t &receiveHeader) {
+    for (size_t spins = 1;; ++spins) {
+        const auto receiveFooter = peekFooter(readPos, receiveHeader);
+        if (receiveFooter == validity) {
+            return true;
+        }
+        if (receiveFooter == endOfStream) {
+            return false;
+        }
+        // Don't wait forever for a remote side, which is gone
+        if (spins % 1024 == 0) {
+            checkConnection();
+        }
+    }
+}
+
+size_t RDMAMessageBuffer::peekFooter(size_t framePos, size_t &receiveHeader) const {
+    size_t receiveFooter = 0;
+    readFromReceiveBuffer(framePos, reinterpret_cast<uint8_t *>(&receiveHeader), sizeof(receiveHeader));
+    readFromReceiveBuffer(framePos + sizeof(receiveHeader) + (receiveHeader & ~moreFragmentsFlag),
+                          reinterpret_cast<uint8_t *>(&receiveFooter), sizeof(receiveFooter));
+    return receiveFooter;
 }
 
-RDMAMessageBuffer::RDMAMessageBuffer(size_t size, int sock) :
+RDMAMessageBuffer::RDMAMessageBuffer(size_t size, int sock, size_t stripes, Network *sharedNetwork,
+                                     uint8_t serviceLevel) :
+        RDMAMessageBuffer(size, sock, stripes, sharedNetwork, serviceLevel, false) {}
+
+RDMAMessageBuffer::RDMAMessageBuffer(size_t size, int sock, size_t stripes, Network *sharedNetwork,
+                                     uint8_t serviceLevel, bool isFanoutPeer) :
         size(size),
-        net(sock),
-        receiveBuffer(make_unique<volatile uint8_t[]>(size)),
-        sendBuffer(make_unique<uint8_t[]>(size)),
-        localSend(sendBuffer.get(), size, net.network.getProtectionDomain(), MemoryRegion::Permission::None),
+        net(sock, stripes, sharedNetwork, serviceLevel),
+        positions(new(allocatePages(sizeof(Positions))) Positions()),
+        receiveBuffer(static_cast<volatile uint8_t *>(allocatePages(size))),
+        readPos(positions->readPos),
+        sendBuffer(static_cast<uint8_t *>(allocatePages(isFanoutPeer ? emptyFrameSize : size))),
+        fanoutPeer(isFanoutPeer),
+        currentRemoteReceive(positions->currentRemoteReceive),
+        localSend(sendBuffer.get(), isFanoutPeer ? emptyFrameSize : size, net.network.getProtectionDomain(),
+                  MemoryRegion::Permission::None),
         localReceive(const_cast<uint8_t *>(receiveBuffer.get()), size, net.network.getProtectionDomain(),
                      MemoryRegion::Permission::LocalWrite | MemoryRegion::Permission::RemoteWrite),
         localReadPos(&readPos, sizeof(readPos), net.network.getProtectionDomain(),
@@ -103,30 +217,8 @@ RDMAMessageBuffer::RDMAMessageBuffer(size_t size, int sock) :
 
     sendRmrInfo(sock, localReceive, localReadPos);
     receiveAndSetupRmr(sock, remoteReceive, remoteReadPos);
-}
 
-/// Higher order wraparound function. Calls the given function func() once or twice, depending on if a wraparound is needed or not
-template<typename Func>
-void wraparound(const size_t totalSize, const size_t todoSize, const size_t pos, Func &&func) {
-    const size_t beginPos = pos & (totalSize - 1);
-    if ((totalSize - beginPos) >= todoSize) {
-        func(0, beginPos, beginPos + todoSize);
-    } else {
-        const auto fst = beginPos;
-        const auto fstToRead = totalSize - beginPos;
-        const auto snd = 0;
-        const auto sndToRead = todoSize - fstToRead;
-        func(0, fst, fst + fstToRead);
-        func(fstToRead, snd, snd + sndToRead);
-    }
-}
-
-/// func(size_t prevBytes, T* begin, T* end)
-template<typename T, typename Func>
-void wraparound(T *buffer, const size_t totalSize, const size_t todoSize, const size_t pos, Func &&func) {
-    wraparound(totalSize, todoSize, pos, [&](auto prevBytes, auto beginPos, auto endPos) {
-        func(prevBytes, buffer + beginPos, buffer + endPos);
-    });
+    stripeWrites.resize(net.stripes.size());
 }
 
 void RDMAMessageBuffer::send(const uint8_t *data, size_t length) {
@@ -134,40 +226,273 @@ void RDMAMessageBuffer::send(const uint8_t *data, size_t length) {
 }
 
 void RDMAMessageBuffer::send(const uint8_t *data, size_t length, bool inln) {
+    if (fanoutPeer) throw runtime_error{"peers of a fanout group must only be sent to through the group"};
+    // The remote side might already have received some fragments of a striped message, when the connection breaks.
+    // So the fragments in the ring stay there and the rest of the message is kept, fallBackToTcp() returns both
+    size_t inRing = 0;
+    try {
+        sendMessage(data, length, inln, inRing);
+    } catch (const NetworkException &) {
+        unsent.insert(unsent.end(), data + inRing, data + length);
+        throw;
+    }
+}
+
+void RDMAMessageBuffer::stage(const uint8_t *data, size_t length) {
+    if (fanoutPeer) throw runtime_error{"peers of a fanout group must only be sent to through the group"};
     const size_t sizeToWrite = sizeof(length) + length + sizeof(validity);
     if (sizeToWrite > size) throw runtime_error{"data > buffersize!"};
 
-    const size_t startOfWrite = sendPos;
+    // The remote side can only make space by reading messages, which have actually been written
+    if (sizeToWrite > size - (sendPos - currentRemoteReceive)) {
+        flush();
+    }
+    waitForSendSpace(sizeToWrite);
 
     writeToSendBuffer(reinterpret_cast<const uint8_t *>(&length), sizeof(length));
     writeToSendBuffer(data, length);
     writeToSendBuffer(reinterpret_cast<const uint8_t *>(&validity), sizeof(validity));
+}
 
-    wraparound(size, sizeToWrite, startOfWrite, [&](auto, auto beginPos, auto endPos) {
+bool RDMAMessageBuffer::waitForStageSpace(size_t length, chrono::steady_clock::time_point deadline) {
+    const size_t sizeToWrite = sizeof(length) + length + sizeof(validity);
+    if (sizeToWrite > size - (sendPos - currentRemoteReceive)) {
+        flush();
+    }
+    return waitForSendSpace(sizeToWrite, deadline);
+}
+
+void RDMAMessageBuffer::flush() {
+    if (flushedPos == sendPos) {
+        return;
+    }
+    WriteWorkRequest writes[2];
+    size_t writeCount = 0;
+    wraparound(size, sendPos - flushedPos, flushedPos, [&](auto, auto beginPos, auto endPos) {
         const auto sendSlice = localSend.slice(beginPos, endPos - beginPos);
+        auto &write = writes[writeCount++];
+        write.setLocalAddress(sendSlice);
+        write.setRemoteAddress(remoteReceive.slice(beginPos));
+        write.setSendInline(sendSlice.size <= net.queuePair.getMaxInlineSize());
+    });
+    if (writeCount == 2) {
+        writes[0].setNextWorkRequest(&writes[1]);
+    }
+    net.queuePair.postWorkRequest(writes[0]);
+    flushedPos = sendPos;
+}
+
+void RDMAMessageBuffer::sendMessage(const uint8_t *data, size_t length, bool inln, size_t &inRing) {
+    // A fragment is in the ring, once it was copied to the send buffer, even if posting its write failed
+    const auto trackFragment = [&](size_t endOfFragment, auto sendIt) {
+        const size_t startOfFragment = sendPos;
+        try {
+            sendIt();
+        } catch (const NetworkException &) {
+            if (sendPos != startOfFragment) {
+                inRing = endOfFragment;
+            }
+            throw;
+        }
+        inRing = endOfFragment;
+    };
+    if (net.stripes.empty() || length < stripeThreshold) {
+        trackFragment(length, [&] { sendFragment(data, length, false, net.queuePair, inln); });
+        return;
+    }
+
+    // Split big messages in fragments and distribute them round robin over all queue pairs. Each fragment is a
+    // complete message in the ring, so the receiver reassembles them simply by reading the ring in order
+    const size_t stripeCount = net.stripes.size() + 1;
+    const size_t maxFragmentSize = size / stripeCount - sizeof(length) - sizeof(validity);
+    const size_t fragmentSize = min((length + stripeCount - 1) / stripeCount, maxFragmentSize);
+    size_t stripe = 0;
+    for (size_t offset = 0; offset < length; offset += fragmentSize) {
+        const size_t toSend = min(fragmentSize, length - offset);
+        const bool moreFragments = offset + toSend < length;
+        trackFragment(offset + toSend, [&] {
+            if (stripe == 0) {
+                sendFragment(data + offset, toSend, moreFragments, net.queuePair, inln);
+                return;
+            }
+            // Unsignaled work requests are only freed with the next signaled one, so signal once in a while
+            const bool signaled = ++stripeWrites[stripe - 1] % stripeSignalInterval == 0;
+            if (signaled) {
+                while (pollSendCompletion() != numeric_limits<uint64_t>::max());
+            }
+            sendFragment(data + offset, toSend, moreFragments, *net.stripes[stripe - 1], inln, signaled);
+        });
+        stripe = (stripe + 1) % stripeCount;
+    }
+}
+
+void RDMAMessageBuffer::sendFragment(const uint8_t *data, size_t length, bool moreFragments, QueuePair &queuePair,
+                                     bool inln, bool signaled) {
+    const size_t header = moreFragments ? (length | moreFragmentsFlag) : length;
+    writeFrame(header, data, length, validity, queuePair, inln, signaled);
+}
+
+void RDMAMessageBuffer::writeFrame(size_t header, const uint8_t *data, size_t length, size_t footer,
+                                   QueuePair &queuePair, bool inln, bool signaled) {
+    const size_t sizeToWrite = sizeof(header) + length + sizeof(footer);
+    if (sizeToWrite > size) throw runtime_error{"data > buffersize!"};
+
+    // Staged messages come first
+    flush();
+    // Wait for the whole frame at once, so it is either completely in the send buffer or not at all
+    waitForSendSpace(sizeToWrite);
+    const size_t startOfWrite = sendPos;
+
+    if (fanoutPeer) {
+        // The messages of fanout peers are written from the group's buffer, their own one only holds an empty frame
+        if (length != 0) throw runtime_error{"peers of a fanout group must only be sent to through the group"};
+        memcpy(sendBuffer.get(), &header, sizeof(header));
+        memcpy(sendBuffer.get() + sizeof(header), &footer, sizeof(footer));
+        sendPos += sizeToWrite;
+    } else {
+        writeToSendBuffer(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+        writeToSendBuffer(data, length);
+        writeToSendBuffer(reinterpret_cast<const uint8_t *>(&footer), sizeof(footer));
+    }
+
+    wraparound(size, sizeToWrite, startOfWrite, [&](auto prevBytes, auto beginPos, auto endPos) {
+        const auto sendSlice = fanoutPeer ? localSend.slice(prevBytes, endPos - beginPos)
+                                          : localSend.slice(beginPos, endPos - beginPos);
         const auto remoteSlice = remoteReceive.slice(beginPos);
-        WriteWorkRequestBuilder(sendSlice, remoteSlice, false)
-                .setInline(inln && sendSlice.size <= net.queuePair.getMaxInlineSize())
-                .send(net.queuePair);
+        const bool lastSlice = prevBytes + sendSlice.size == sizeToWrite;
+        WriteWorkRequestBuilder(sendSlice, remoteSlice, signaled && lastSlice)
+                .setInline(inln && sendSlice.size <= queuePair.getMaxInlineSize())
+                .send(queuePair);
     });
+    flushedPos = sendPos;
 }
 
 void RDMAMessageBuffer::writeToSendBuffer(const uint8_t *data, size_t sizeToWrite) {
+    waitForSendSpace(sizeToWrite);
+
+    wraparound(sendBuffer.get(), size, sizeToWrite, sendPos, [&](auto prevBytes, auto begin, auto end) {
+        copy(data + prevBytes, data + prevBytes + distance(begin, end), begin);
+    });
+
+    sendPos += sizeToWrite;
+}
+
+void RDMAMessageBuffer::readFromSendBuffer(size_t readPos, uint8_t *whereTo, size_t sizeToRead) const {
+    wraparound(sendBuffer.get(), size, sizeToRead, readPos, [whereTo](auto prevBytes, auto begin, auto end) {
+        copy(begin, end, whereTo + prevBytes);
+    });
+}
+
+void RDMAMessageBuffer::waitForSendSpace(size_t sizeToWrite) {
+    waitForSendSpace(sizeToWrite, chrono::steady_clock::time_point::max());
+}
+
+bool RDMAMessageBuffer::waitForSendSpace(size_t sizeToWrite, chrono::steady_clock::time_point deadline) {
     // Make sure, there is enough space
     size_t safeToWrite = size - (sendPos - currentRemoteReceive);
     while (sizeToWrite > safeToWrite) {
         ReadWorkRequestBuilder(localCurrentRemoteReceive, remoteReadPos, true)
                 .send(net.queuePair);
-        while (net.completionQueue.pollSendCompletionQueue() !=
-               ReadWorkRequest::getId()); // Poll until read has finished
+        if (not waitForReadPos(deadline)) {
+            return false;
+        }
         safeToWrite = size - (sendPos - currentRemoteReceive);
     }
+    return true;
+}
 
-    wraparound(sendBuffer.get(), size, sizeToWrite, sendPos, [&](auto prevBytes, auto begin, auto end) {
-        copy(data + prevBytes, data + prevBytes + distance(begin, end), begin);
-    });
+bool RDMAMessageBuffer::waitForReadPos(chrono::steady_clock::time_point deadline) {
+    for (;;) {
+        const auto completion = pollSendCompletion();
+        if (completion == ReadWorkRequest::getId()) {
+            return true;
+        }
+        // Only look at the clock, when there is nothing to do anyway
+        if (completion == numeric_limits<uint64_t>::max() && chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+    }
+}
 
-    sendPos += sizeToWrite;
+void RDMAMessageBuffer::shutdown() {
+    if (not endOfStreamSent) {
+        writeFrame(0, nullptr, 0, endOfStream, net.queuePair, true, false);
+        endOfStreamSent = true;
+    }
+}
+
+void RDMAMessageBuffer::close() {
+    finishClose(startClose());
+}
+
+chrono::steady_clock::time_point RDMAMessageBuffer::startClose() {
+    // After its end of the stream, the remote side either closed as well and won't answer anymore, or it still reads
+    // and answers within a round trip. Either way, waiting the whole timeout doesn't help
+    const bool remoteClosing = endOfStreamReceived();
+    const auto now = chrono::steady_clock::now();
+    const auto deadline = now + (remoteClosing ? chrono::steady_clock::duration(remoteClosingTimeout) : closeTimeout);
+    drainsOutstanding = 0;
+    try {
+        // Tell the remote side, that nothing follows. If it doesn't read anymore, it doesn't need to know
+        if (waitForSendSpace(sizeof(size_t) + sizeof(endOfStream), remoteClosing ? now : deadline)) {
+            shutdown();
+        }
+
+        // Work requests of a queue pair complete in order, so a signaled read behind the writes drains all of them
+        ReadWorkRequestBuilder(localCurrentRemoteReceive, remoteReadPos, true)
+                .send(net.queuePair);
+        for (auto &stripe : net.stripes) {
+            ReadWorkRequestBuilder(localCurrentRemoteReceive, remoteReadPos, true)
+                    .send(*stripe);
+        }
+        drainsOutstanding = net.stripes.size() + 1;
+    } catch (const NetworkException &) {
+        // The connection is broken anyway, the queue pairs are reset by finishClose()
+    }
+    return deadline;
+}
+
+void RDMAMessageBuffer::finishClose(chrono::steady_clock::time_point deadline) {
+    try {
+        while (drainsOutstanding > 0 && waitForReadPos(deadline)) {
+            --drainsOutstanding;
+        }
+    } catch (const NetworkException &) {
+        // The connection is broken anyway
+    }
+    drainsOutstanding = 0;
+
+    net.disconnect();
+}
+
+bool RDMAMessageBuffer::endOfStreamReceived() const {
+    for (size_t framePos = readPos; framePos - readPos < size;) {
+        size_t receiveHeader;
+        const auto receiveFooter = peekFooter(framePos, receiveHeader);
+        if (receiveFooter != validity) {
+            return receiveFooter == endOfStream;
+        }
+        framePos += sizeof(receiveHeader) + (receiveHeader & ~moreFragmentsFlag) + sizeof(receiveFooter);
+    }
+    return false;
+}
+
+void RDMAMessageBuffer::reconnect(int sock, size_t stripes, uint8_t serviceLevel) {
+    net.connect(sock, stripes, serviceLevel);
+
+    // Start over with a clean ring. The remote side only writes, after it received our memory region info
+    readPos = 0;
+    sendPos = 0;
+    flushedPos = 0;
+    endOfStreamSent = false;
+    unsent.clear();
+    currentRemoteReceive = 0;
+    zeroReceiveBuffer(0, size);
+
+    sendRmrInfo(sock, localReceive, localReadPos);
+    receiveAndSetupRmr(sock, remoteReceive, remoteReadPos);
+
+    stripeWrites.assign(net.stripes.size(), 0);
 }
 
 void RDMAMessageBuffer::readFromReceiveBuffer(size_t readPos, uint8_t *whereTo, size_t sizeToRead) const {
@@ -184,17 +509,215 @@ void RDMAMessageBuffer::zeroReceiveBuffer(size_t beginReceiveCount, size_t sizeT
 }
 
 bool RDMAMessageBuffer::hasData() const {
-    size_t receiveSize;
-    auto receiveValidity = static_cast<decltype(validity)>(0);
-    readFromReceiveBuffer(readPos, reinterpret_cast<uint8_t *>(&receiveSize), sizeof(receiveSize));
-    readFromReceiveBuffer(readPos + sizeof(receiveSize) + receiveSize, reinterpret_cast<uint8_t *>(&receiveValidity),
-                          sizeof(receiveValidity));
-    return (receiveValidity == validity);
+    size_t receiveHeader;
+    const auto receiveFooter = peekFooter(readPos, receiveHeader);
+    return receiveFooter == validity || receiveFooter == endOfStream;
+}
+
+bool RDMAMessageBuffer::remoteShutdown() const {
+    size_t receiveHeader;
+    return peekFooter(readPos, receiveHeader) == endOfStream;
+}
+
+size_t RDMAMessageBuffer::availableBytes() const {
+    // Only whole messages can be received, so fragments count, once their last fragment arrived as well
+    size_t available = 0;
+    size_t messageSize = 0;
+    for (size_t framePos = readPos; framePos - readPos < size;) {
+        size_t receiveHeader;
+        if (peekFooter(framePos, receiveHeader) != validity) {
+            break;
+        }
+        const size_t receiveSize = receiveHeader & ~moreFragmentsFlag;
+        messageSize += receiveSize;
+        framePos += sizeof(receiveHeader) + receiveSize + sizeof(validity);
+        if ((receiveHeader & moreFragmentsFlag) == 0) {
+            available += messageSize;
+            messageSize = 0;
+        }
+    }
+    return available;
+}
+
+size_t RDMAMessageBuffer::unreceivedBytes() {
+    if (fanoutPeer) throw runtime_error{"the send positions of fanout group peers are tracked by the group"};
+    ReadWorkRequestBuilder(localCurrentRemoteReceive, remoteReadPos, true)
+            .send(net.queuePair);
+    waitForReadPos(chrono::steady_clock::now() + closeTimeout);
+    // The end of the stream is never consumed by the remote side
+    const size_t endOfStreamFrame = endOfStreamSent ? sizeof(size_t) + sizeof(endOfStream) : 0;
+    return sendPos - currentRemoteReceive - endOfStreamFrame;
+}
+
+uint64_t RDMAMessageBuffer::pollSendCompletion() {
+    const auto completion = net.completionQueue.pollSendCompletionQueue();
+    if (completion == heartbeatId) {
+        heartbeatOutstanding = false;
+    }
+    return completion;
+}
+
+void RDMAMessageBuffer::checkConnection() {
+    const auto now = chrono::steady_clock::now();
+    if (now - lastCheck < checkInterval) {
+        return;
+    }
+    lastCheck = now;
+
+    bool failed = net.queuePair.hasFailed();
+    for (auto &stripe : net.stripes) {
+        failed |= stripe->hasFailed();
+    }
+    if (failed) {
+        string reason = "the RDMA connection broke";
+        cerr << reason << endl;
+        throw NetworkException(reason);
+    }
+
+    // An idle connection doesn't notice a dead remote side, so read from it once in a while. Without an answer, the
+    // read fails after the ack timeout and its retries, which throws when polling its completion
+    if (not heartbeatOutstanding) {
+        ReadWorkRequest heartbeat;
+        heartbeat.setLocalAddress(localCurrentRemoteReceive);
+        heartbeat.setRemoteAddress(remoteReadPos);
+        heartbeat.setCompletion(true);
+        heartbeat.setId(heartbeatId);
+        net.queuePair.postWorkRequest(heartbeat);
+        heartbeatOutstanding = true;
+    }
+    while (pollSendCompletion() != numeric_limits<uint64_t>::max());
+}
+
+/// Tell the remote side our position and get its one. Unlike tcp_read(), this notices a closed socket and short reads
+static uint64_t exchangePosition(int sock, uint64_t ownPosition) {
+    if (send(sock, &ownPosition, sizeof(ownPosition), MSG_NOSIGNAL) != sizeof(ownPosition)) {
+        string reason = "can't send the position for resynchronizing: " + string(strerror(errno));
+        cerr << reason << endl;
+        throw NetworkException(reason);
+    }
+    uint64_t remotePosition = 0;
+    auto bytes = reinterpret_cast<uint8_t *>(&remotePosition);
+    for (size_t received = 0; received < sizeof(remotePosition);) {
+        const auto result = recv(sock, bytes + received, sizeof(remotePosition) - received, 0);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            string reason = "can't receive the remote position for resynchronizing: " +
+                            string(result == 0 ? "the remote side closed the socket" : strerror(errno));
+            cerr << reason << endl;
+            throw NetworkException(reason);
+        }
+        received += result;
+    }
+    return remotePosition;
 }
 
-RDMANetworking::RDMANetworking(int sock) :
+vector<uint8_t> RDMAMessageBuffer::fallBackToTcp(int sock) {
+    if (fanoutPeer) throw runtime_error{"the sent messages of fanout group peers are only in the group's buffer"};
+    // After the reset, the remote side can't write to the receive ring anymore
+    net.disconnect();
+    heartbeatOutstanding = false;
+
+    // Find the end of the completely received messages. Fragments of striped messages may arrive out of order, so
+    // everything after the first incomplete frame is dropped
+    size_t receivedPos = readPos;
+    size_t framePos = readPos;
+    size_t keepUntil = readPos;
+    while (framePos - readPos < size) {
+        size_t receiveHeader;
+        const auto receiveFooter = peekFooter(framePos, receiveHeader);
+        if (receiveFooter == endOfStream && framePos == receivedPos) {
+            keepUntil = framePos + sizeof(receiveHeader) + sizeof(receiveFooter);
+            break;
+        }
+        if (receiveFooter != validity) {
+            break;
+        }
+        framePos += sizeof(receiveHeader) + (receiveHeader & ~moreFragmentsFlag) + sizeof(receiveFooter);
+        if ((receiveHeader & moreFragmentsFlag) == 0) {
+            receivedPos = framePos;
+            keepUntil = framePos;
+        }
+    }
+    zeroReceiveBuffer(keepUntil, readPos + size - keepUntil);
+
+    tcp_setBlocking(sock);
+    const uint64_t remoteReceived = exchangePosition(sock, receivedPos);
+
+    // Flow control guarantees, that nothing after the remote read position has been overwritten yet
+    if (remoteReceived > sendPos || sendPos - remoteReceived > size) {
+        string reason = "can't resynchronize with the remote side at position " + to_string(remoteReceived);
+        cerr << reason << endl;
+        throw NetworkException(reason);
+    }
+
+    // Collect the contents of all frames the remote side didn't receive completely
+    vector<uint8_t> unreceived;
+    for (size_t pos = remoteReceived; pos < sendPos;) {
+        size_t header;
+        size_t footer;
+        readFromSendBuffer(pos, reinterpret_cast<uint8_t *>(&header), sizeof(header));
+        const size_t length = header & ~moreFragmentsFlag;
+        readFromSendBuffer(pos + sizeof(header) + length, reinterpret_cast<uint8_t *>(&footer), sizeof(footer));
+        if (footer == endOfStream) {
+            break;
+        }
+        const auto alreadyCollected = unreceived.size();
+        unreceived.resize(alreadyCollected + length);
+        readFromSendBuffer(pos + sizeof(header), unreceived.data() + alreadyCollected, length);
+        pos += sizeof(header) + length + sizeof(footer);
+    }
+    // The rest of a message, whose send() failed, follows its fragments in the ring
+    unreceived.insert(unreceived.end(), unsent.begin(), unsent.end());
+    unsent.clear();
+    return unreceived;
+}
+
+void *allocatePages(size_t size) {
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const size_t allocationSize = (size + pageSize - 1) & ~(pageSize - 1);
+    auto pages = aligned_alloc(pageSize, allocationSize);
+    if (pages == nullptr) {
+        throw bad_alloc();
+    }
+    memset(pages, 0, allocationSize);
+    return pages;
+}
+
+RDMANetworking::RDMANetworking(int sock, size_t stripeCount, Network *sharedNetwork, uint8_t serviceLevel) :
+        ownNetwork(sharedNetwork == nullptr ? make_unique<Network>() : nullptr),
+        network(sharedNetwork == nullptr ? *ownNetwork : *sharedNetwork),
         completionQueue(network),
         queuePair(network, completionQueue) {
+    connect(sock, stripeCount, serviceLevel);
+}
+
+void RDMANetworking::disconnect() {
+    queuePair.disconnect();
+    for (auto &stripe : stripes) {
+        stripe->disconnect();
+    }
+    completionQueue.discardCompletions();
+}
+
+void RDMANetworking::connect(int sock, size_t stripeCount, uint8_t serviceLevel) {
     tcp_setBlocking(sock); // just set the socket to block for our setup.
-    exchangeQPNAndConnect(sock, network, queuePair);
+    exchangeQPNAndConnect(sock, network, queuePair, serviceLevel);
+
+    // Both sides need the same number of queue pairs, so agree on the smaller stripe count
+    uint64_t ownStripes = min(max(stripeCount, size_t(1)), maxStripes);
+    uint64_t remoteStripes = 0;
+    tcp_write(sock, &ownStripes, sizeof(ownStripes));
+    tcp_read(sock, &remoteStripes, sizeof(remoteStripes));
+
+    // Queue pairs of a previous connection are reused, as far as they are needed
+    const size_t additionalQueuePairs = min(ownStripes, remoteStripes) - 1;
+    stripes.resize(min(stripes.size(), additionalQueuePairs));
+    while (stripes.size() < additionalQueuePairs) {
+        stripes.push_back(make_unique<QueuePair>(network, completionQueue));
+    }
+    for (auto &stripe : stripes) {
+        exchangeQPNAndConnect(sock, network, *stripe, serviceLevel);
+    }
 }
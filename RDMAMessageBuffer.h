@@ -2,58 +2,226 @@
 #define RDMA_HASH_MAP_RDMAMESSAGEBUFFER_H
 
 #include <atomic>
+#include <chrono>
 #include "rdma/Network.hpp"
 #include "rdma/CompletionQueuePair.hpp"
 #include "rdma/QueuePair.hpp"
 #include "rdma/MemoryRegion.hpp"
 
+/// Frees memory from allocatePages()
+struct PageDeleter {
+    template<typename T>
+    void operator()(T *pages) const {
+        free(const_cast<void *>(static_cast<volatile void *>(pages)));
+    }
+};
+
+/// Allocate zeroed memory on pages of its own. With fork support, registered memory is not mapped in forked children,
+/// so it must not share its pages with any other data.
+void *allocatePages(size_t size);
+
 struct RDMANetworking {
-    rdma::Network network;
+    std::unique_ptr<rdma::Network> ownNetwork;
+    rdma::Network &network;
     rdma::CompletionQueuePair completionQueue;
     rdma::QueuePair queuePair;
+    /// Additional queue pairs to stripe big messages over
+    std::vector<std::unique_ptr<rdma::QueuePair>> stripes;
 
     /// Exchange the basic RDMA connection info for the network and queues
-    RDMANetworking(int sock);
+    /// Both sides negotiate the number of queue pairs used, the minimum of both stripeCounts is used
+    /// When a sharedNetwork is given, the queues are created in it, instead of opening the device again
+    RDMANetworking(int sock, size_t stripeCount = 1, rdma::Network *sharedNetwork = nullptr,
+                   uint8_t serviceLevel = 0);
+
+    /// Connect the queue pairs to the remote side. Disconnected queue pairs can be connected to a new remote side
+    void connect(int sock, size_t stripeCount = 1, uint8_t serviceLevel = 0);
+
+    /// Flush all outstanding work and reset the queue pairs, so they can be connected again
+    void disconnect();
 };
 
 class RDMAMessageBuffer {
+    friend class RDMAFanoutGroup;
+
 public:
 
     /// Send data to the remote site
+    /// If the connection breaks, the message isn't lost: fallBackToTcp() returns everything of it, which the remote
+    /// side didn't receive
     void send(const uint8_t *data, size_t length);
 
     void send(const uint8_t *data, size_t length, bool inln);
 
+    /// Copy a message to the send ring without writing it to the remote side yet. All staged messages are written
+    /// together by the next flush() or send()
+    void stage(const uint8_t *data, size_t length);
+
+    /// Write all staged messages to the remote side, with a single work request if they don't wrap around the ring
+    void flush();
+
+    /// Wait until a message of the given length can be stage()d without blocking, or give up after the deadline.
+    /// Writes the staged messages, if the remote side needs them to make space
+    bool waitForStageSpace(size_t length, std::chrono::steady_clock::time_point deadline);
+
     /// Receive data to a freshly allocated data vector
+    /// Returns an empty vector, after the remote side shut down and all of its messages were received
     std::vector<uint8_t> receive();
 
     /// Receive to a specific memory region with at last maxSize
+    /// Returns 0, after the remote side shut down and all of its messages were received
     size_t receive(void *whereTo, size_t maxSize);
 
+    /// Like receive(), but a message bigger than maxSize is skipped completely instead of throwing. Returns false then
+    bool receiveOrSkip(void *whereTo, size_t maxSize, size_t &received);
+
+    /// Zero copy receive: Wait for the next message and point to it in the receive ring, where it stays until release().
+    /// Returns false, if the message isn't stored in one piece (it wraps around the ring or was striped), receive() it
+    /// instead. After the remote side shut down, data is nullptr and length 0
+    bool peek(const uint8_t *&data, size_t &length);
+
+    /// Free the message from peek(), afterwards it isn't accessible anymore
+    void release();
+
+    /// Tell the remote side, that no more messages follow. Receiving is still possible
+    void shutdown();
+
     /// Construct a message buffer of the given size, exchanging RDMA networking information over the given socket
     /// size _must_ be a power of 2.
-    RDMAMessageBuffer(size_t size, int sock);
+    /// Messages bigger than 64KB are striped over the given number of queue pairs, to use more of the bandwidth
+    /// Memory of a sharedNetwork can be used by all buffers created in it
+    /// A higher serviceLevel can be used to prioritize the traffic of this buffer in the fabric
+    RDMAMessageBuffer(size_t size, int sock, size_t stripes = 1, rdma::Network *sharedNetwork = nullptr,
+                      uint8_t serviceLevel = 0);
 
-    /// whether there is data to be read non-blockingly
+    /// whether there is data to be read non-blockingly, this includes the end of the stream
     bool hasData() const;
 
+    /// whether the remote side shut down and all of its messages were received
+    bool remoteShutdown() const;
+
+    /// How many bytes can be received without blocking, i.e. the contents of all completely received messages
+    size_t availableBytes() const;
+
+    /// How many bytes the remote side hasn't received yet, including the framing of the messages.
+    /// Asks the remote side for its current position first
+    size_t unreceivedBytes();
+
+    /// Throw a NetworkException, if the connection broke or the remote side is unreachable.
+    /// Only actually checks every few milliseconds, so it can be called in busy loops
+    void checkConnection();
+
+    /// Continue over the still open TCP socket after the RDMA connection broke. Both sides exchange, how far they
+    /// received messages completely. These messages can still be received from the ring, everything after them is
+    /// returned and needs to be sent again over the socket. Afterwards, the socket is used as usual, until the buffer
+    /// is connected again with reconnect(). Throws a NetworkException, if the socket closed or the positions don't match
+    std::vector<uint8_t> fallBackToTcp(int sock);
+
+    /// Notify the remote side, wait (bounded) until all outstanding writes have finished and reset the connection.
+    /// Afterwards, the buffer can be reused for a new connection with reconnect()
+    void close();
+
+    /// close() in two steps, so several buffers wait for their remote sides at the same time: startClose() notifies the
+    /// remote side and starts draining the writes, finishClose() waits for them until the deadline from startClose()
+    std::chrono::steady_clock::time_point startClose();
+
+    void finishClose(std::chrono::steady_clock::time_point deadline);
+
+    /// Connect a closed buffer to a new remote side, reusing its queue pairs and registered memory.
+    /// Both sides need buffers of the same size
+    void reconnect(int sock, size_t stripes = 1, uint8_t serviceLevel = 0);
+
+    /// The network this buffer was created in, e.g. to create further buffers for the same connection
+    rdma::Network &getNetwork() { return net.network; }
+
+    /// The size of the ring, in which messages are exchanged
+    size_t getSize() const { return size; }
+
+    /// The biggest message, which fits into the ring with its framing and can be stage()d
+    size_t maxStageSize() const { return size - sizeof(size_t) - sizeof(validity); }
+
 private:
+    static const size_t validity;
+    /// Written instead of the validity by close(), no further messages follow
+    static const size_t endOfStream;
+
+    /// Positions accessed by the remote side
+    struct Positions {
+        std::atomic<size_t> readPos{0};
+        volatile size_t currentRemoteReceive = 0;
+    };
+
     const size_t size;
     RDMANetworking net;
-    std::unique_ptr<volatile uint8_t[]> receiveBuffer;
-    std::atomic<size_t> readPos{0};
-    std::unique_ptr<uint8_t[]> sendBuffer;
+    std::unique_ptr<Positions, PageDeleter> positions;
+    std::unique_ptr<volatile uint8_t[], PageDeleter> receiveBuffer;
+    std::atomic<size_t> &readPos;
+    std::unique_ptr<uint8_t[], PageDeleter> sendBuffer;
     size_t sendPos = 0;
-    volatile size_t currentRemoteReceive = 0;
+    /// Everything before it has been written to the remote side, the rest is staged
+    size_t flushedPos = 0;
+    bool endOfStreamSent = false;
+    /// The part of a message, which didn't make it into the send ring before the connection broke
+    std::vector<uint8_t> unsent;
+    bool heartbeatOutstanding = false;
+    /// Reads of the remote position, which startClose() posted to drain the writes
+    size_t drainsOutstanding = 0;
+    /// Sent to by an RDMAFanoutGroup from its shared buffer, so there is no own send ring. The send buffer only holds the
+    /// empty frame of shutdown()
+    const bool fanoutPeer;
+    std::chrono::steady_clock::time_point lastCheck;
+    volatile size_t &currentRemoteReceive;
     rdma::MemoryRegion localSend;
     rdma::MemoryRegion localReceive;
     rdma::MemoryRegion localReadPos;
     rdma::MemoryRegion localCurrentRemoteReceive;
     rdma::RemoteMemoryRegion remoteReceive;
     rdma::RemoteMemoryRegion remoteReadPos;
+    std::vector<size_t> stripeWrites;
+
+    /// Used by RDMAFanoutGroup to create its peers without a send ring of their own
+    RDMAMessageBuffer(size_t size, int sock, size_t stripes, rdma::Network *sharedNetwork, uint8_t serviceLevel,
+                      bool isFanoutPeer);
+
+    /// inRing is the part of the message, which has been written to the send ring, even if this throws
+    void sendMessage(const uint8_t *data, size_t length, bool inln, size_t &inRing);
+
+    void sendFragment(const uint8_t *data, size_t length, bool moreFragments, rdma::QueuePair &queuePair, bool inln,
+                      bool signaled = false);
+
+    /// Write [header][data][footer] to the remote ring
+    void writeFrame(size_t header, const uint8_t *data, size_t length, size_t footer, rdma::QueuePair &queuePair,
+                    bool inln, bool signaled);
+
+    /// Receive the next message, skipping it if it is bigger than maxSize and skipTooBig is set. Otherwise that throws
+    size_t receiveMessage(void *whereTo, size_t maxSize, bool skipTooBig, bool &skipped);
+
+    /// Spin until the next fragment has been received completely and get its header
+    /// Returns false, if the end of the stream was received instead
+    bool waitForFragment(size_t &receiveHeader);
+
+    /// Read the header and the footer of the frame at the given position in the receive ring
+    size_t peekFooter(size_t framePos, size_t &receiveHeader) const;
+
+    /// Whether the end of the stream is in the receive ring, even if messages before it weren't received yet
+    bool endOfStreamReceived() const;
 
     void writeToSendBuffer(const uint8_t *data, size_t sizeToWrite);
 
+    void readFromSendBuffer(size_t readPos, uint8_t *whereTo, size_t sizeToRead) const;
+
+    /// Block until the remote side has read enough, to write sizeToWrite bytes
+    void waitForSendSpace(size_t sizeToWrite);
+
+    /// Like waitForSendSpace, but give up after the deadline
+    bool waitForSendSpace(size_t sizeToWrite, std::chrono::steady_clock::time_point deadline);
+
+    /// Poll until a read of the remote readPos has finished or the deadline passed
+    bool waitForReadPos(std::chrono::steady_clock::time_point deadline);
+
+    /// Poll the send completion queue once, keeping track of the heartbeats
+    uint64_t pollSendCompletion();
+
     void readFromReceiveBuffer(size_t readPos, uint8_t *whereTo, size_t sizeToRead) const;
 
     void zeroReceiveBuffer(size_t beginReceiveCount, size_t sizeToZero);
@@ -0,0 +1,220 @@
+#include "RDMAPullMessageBuffer.h"
+#include <limits>
+#include "rdma/WorkRequest.hpp"
+#include "tcpWrapper.h"
+#include "wraparound.h"
+
+using namespace std;
+using namespace rdma;
+
+static const uint64_t sendPosReadId = 1;
+static const uint64_t dataReadId = 2;
+
+struct PullRmrInfo {
+    uint32_t sendBufferKey;
+    uint32_t sendPosKey;
+    uint32_t pulledPosKey;
+    uintptr_t sendBufferAddress;
+    uintptr_t sendPosAddress;
+    uintptr_t pulledPosAddress;
+};
+
+static void receiveAndSetupRmr(int sock, RemoteMemoryRegion &sendBuffer, RemoteMemoryRegion &sendPos,
+                               RemoteMemoryRegion &pulledPos) {
+    PullRmrInfo rmrInfo{};
+    tcp_read(sock, &rmrInfo, sizeof(rmrInfo));
+    sendBuffer.key = rmrInfo.sendBufferKey;
+    sendBuffer.address = rmrInfo.sendBufferAddress;
+    sendPos.key = rmrInfo.sendPosKey;
+    sendPos.address = rmrInfo.sendPosAddress;
+    pulledPos.key = rmrInfo.pulledPosKey;
+    pulledPos.address = rmrInfo.pulledPosAddress;
+}
+
+static void sendRmrInfo(int sock, const MemoryRegion &sendBuffer, const MemoryRegion &sendPos,
+                        const MemoryRegion &pulledPos) {
+    PullRmrInfo rmrInfo{};
+    rmrInfo.sendBufferKey = sendBuffer.key->rkey;
+    rmrInfo.sendBufferAddress = reinterpret_cast<uintptr_t>(sendBuffer.address);
+    rmrInfo.sendPosKey = sendPos.key->rkey;
+    rmrInfo.sendPosAddress = reinterpret_cast<uintptr_t>(sendPos.address);
+    rmrInfo.pulledPosKey = pulledPos.key->rkey;
+    rmrInfo.pulledPosAddress = reinterpret_cast<uintptr_t>(pulledPos.address);
+    tcp_write(sock, &rmrInfo, sizeof(rmrInfo));
+}
+
+RDMAPullMessageBuffer::RDMAPullMessageBuffer(size_t size, int sock) :
+        size(size),
+        net(sock),
+        sendBuffer(make_unique<uint8_t[]>(size)),
+        receiveBuffer(make_unique<uint8_t[]>(size)),
+        localSend(sendBuffer.get(), size, net.network.getProtectionDomain(), MemoryRegion::Permission::RemoteRead),
+        localSendPos(&sendPos, sizeof(sendPos), net.network.getProtectionDomain(),
+                     MemoryRegion::Permission::RemoteRead),
+        localCurrentRemotePulled(const_cast<size_t *>(&currentRemotePulled), sizeof(currentRemotePulled),
+                                 net.network.getProtectionDomain(), MemoryRegion::Permission::LocalWrite),
+        localReceive(receiveBuffer.get(), size, net.network.getProtectionDomain(),
+                     MemoryRegion::Permission::LocalWrite),
+        localPulledPos(&pulledPos, sizeof(pulledPos), net.network.getProtectionDomain(),
+                       MemoryRegion::Permission::RemoteRead),
+        localCurrentRemoteSendPos(const_cast<size_t *>(&currentRemoteSendPos), sizeof(currentRemoteSendPos),
+                                  net.network.getProtectionDomain(), MemoryRegion::Permission::LocalWrite) {
+    const bool powerOfTwo = (size != 0) && !(size & (size - 1));
+    if (not powerOfTwo) {
+        throw runtime_error{"size should be a power of 2"};
+    }
+
+    tcp_setBlocking(sock); // just set the socket to block for our setup.
+
+    sendRmrInfo(sock, localSend, localSendPos, localPulledPos);
+    receiveAndSetupRmr(sock, remoteSend, remoteSendPos, remotePulledPos);
+}
+
+void RDMAPullMessageBuffer::send(const uint8_t *data, size_t length) {
+    const size_t sizeToWrite = sizeof(length) + length;
+    if (sizeToWrite > size) throw runtime_error{"data > buffersize!"};
+
+    const size_t startOfWrite = sendPos.load(memory_order_relaxed);
+
+    // Make sure, there is enough space, i.e. the remote side already pulled the old data
+    size_t safeToWrite = size - (startOfWrite - currentRemotePulled);
+    while (sizeToWrite > safeToWrite) {
+        ReadWorkRequestBuilder(localCurrentRemotePulled, remotePulledPos, true)
+                .send(net.queuePair);
+        waitForRead(ReadWorkRequest::getId());
+        safeToWrite = size - (startOfWrite - currentRemotePulled);
+    }
+
+    writeToSendBuffer(startOfWrite, reinterpret_cast<const uint8_t *>(&length), sizeof(length));
+    writeToSendBuffer(startOfWrite + sizeof(length), data, length);
+
+    // Only publish the message, after it has been completely written
+    sendPos.store(startOfWrite + sizeToWrite, memory_order_release);
+}
+
+vector<uint8_t> RDMAPullMessageBuffer::receive() {
+    size_t receiveSize = 0;
+    while (not nextMessageSize(receiveSize)) {
+        pull();
+    }
+
+    auto result = vector<uint8_t>(receiveSize);
+    readFromReceiveBuffer(readPos + sizeof(receiveSize), result.data(), receiveSize);
+    readPos += sizeof(receiveSize) + receiveSize;
+
+    return result;
+}
+
+size_t RDMAPullMessageBuffer::receive(void *whereTo, size_t maxSize) {
+    size_t receiveSize = 0;
+    while (not nextMessageSize(receiveSize)) {
+        pull();
+    }
+
+    if (receiveSize > maxSize) {
+        throw runtime_error{"plz only read whole messages for now!"}; // probably buffer partially read msgs
+    }
+    readFromReceiveBuffer(readPos + sizeof(receiveSize), reinterpret_cast<uint8_t *>(whereTo), receiveSize);
+    readPos += sizeof(receiveSize) + receiveSize;
+
+    return receiveSize;
+}
+
+size_t RDMAPullMessageBuffer::pull() {
+    postSendPosRead();
+    waitForRead(sendPosReadId);
+    postDataRead();
+    const auto pulled = pendingPull;
+    if (pulled != 0) {
+        waitForRead(dataReadId);
+        finishDataRead();
+    }
+    return pulled;
+}
+
+void RDMAPullMessageBuffer::pullAll(const vector<RDMAPullMessageBuffer *> &buffers) {
+    // Each step is posted for all connections first, so the round trips overlap instead of adding up
+    for (auto buffer : buffers) {
+        buffer->postSendPosRead();
+    }
+    for (auto buffer : buffers) {
+        buffer->waitForRead(sendPosReadId);
+        buffer->postDataRead();
+    }
+    for (auto buffer : buffers) {
+        if (buffer->pendingPull != 0) {
+            buffer->waitForRead(dataReadId);
+            buffer->finishDataRead();
+        }
+    }
+}
+
+bool RDMAPullMessageBuffer::hasData() const {
+    size_t receiveSize;
+    return nextMessageSize(receiveSize);
+}
+
+void RDMAPullMessageBuffer::postSendPosRead() {
+    ReadWorkRequest read;
+    read.setLocalAddress(localCurrentRemoteSendPos);
+    read.setRemoteAddress(remoteSendPos);
+    read.setCompletion(true);
+    read.setId(sendPosReadId);
+    net.queuePair.postWorkRequest(read);
+}
+
+void RDMAPullMessageBuffer::postDataRead() {
+    const size_t startOfRead = pulledPos.load(memory_order_relaxed);
+    const size_t published = currentRemoteSendPos;
+    const size_t freeSpace = size - (startOfRead - readPos);
+    pendingPull = min(published - startOfRead, freeSpace);
+    if (pendingPull == 0) {
+        return;
+    }
+
+    // Both rings have the same size, so the positions of the remote and the local ring always line up
+    ReadWorkRequest reads[2];
+    size_t readCount = 0;
+    wraparound(size, pendingPull, startOfRead, [&](auto, auto beginPos, auto endPos) {
+        auto &read = reads[readCount++];
+        read.setLocalAddress(localReceive.slice(beginPos, endPos - beginPos));
+        read.setRemoteAddress(remoteSend.slice(beginPos));
+    });
+    if (readCount == 2) {
+        reads[0].setNextWorkRequest(&reads[1]);
+    }
+    reads[readCount - 1].setCompletion(true);
+    reads[readCount - 1].setId(dataReadId);
+    net.queuePair.postWorkRequest(reads[0]);
+}
+
+void RDMAPullMessageBuffer::finishDataRead() {
+    // Publishing the new pulled position also frees the space in the remote send ring
+    pulledPos.store(pulledPos.load(memory_order_relaxed) + pendingPull, memory_order_release);
+    pendingPull = 0;
+}
+
+void RDMAPullMessageBuffer::waitForRead(uint64_t id) {
+    while (net.completionQueue.pollSendCompletionQueue() != id); // Poll until read has finished
+}
+
+void RDMAPullMessageBuffer::writeToSendBuffer(size_t writePos, const uint8_t *data, size_t sizeToWrite) {
+    wraparound(sendBuffer.get(), size, sizeToWrite, writePos, [&](auto prevBytes, auto begin, auto end) {
+        copy(data + prevBytes, data + prevBytes + distance(begin, end), begin);
+    });
+}
+
+void RDMAPullMessageBuffer::readFromReceiveBuffer(size_t readPos, uint8_t *whereTo, size_t sizeToRead) const {
+    wraparound(receiveBuffer.get(), size, sizeToRead, readPos, [whereTo](auto prevBytes, auto begin, auto end) {
+        copy(begin, end, whereTo + prevBytes);
+    });
+}
+
+bool RDMAPullMessageBuffer::nextMessageSize(size_t &messageSize) const {
+    const size_t available = pulledPos.load(memory_order_relaxed) - readPos;
+    if (available < sizeof(messageSize)) {
+        return false;
+    }
+    readFromReceiveBuffer(readPos, reinterpret_cast<uint8_t *>(&messageSize), sizeof(messageSize));
+    return available >= sizeof(messageSize) + messageSize;
+}
@@ -0,0 +1,74 @@
+#ifndef RDMA_HASH_MAP_RDMAPULLMESSAGEBUFFER_H
+#define RDMA_HASH_MAP_RDMAPULLMESSAGEBUFFER_H
+
+#include <atomic>
+#include <vector>
+#include "RDMAMessageBuffer.h"
+
+/// Receiver driven variant of the RDMAMessageBuffer: Instead of writing into the remote ring, send() only publishes
+/// messages in the local send ring and advances a tail pointer. The receiving side pulls them with RDMA READs, whenever
+/// it has capacity, so a server with many clients isn't interrupted by writes into all of its rings.
+class RDMAPullMessageBuffer {
+public:
+
+    /// Publish data in the local ring, where the remote site can pull it from
+    void send(const uint8_t *data, size_t length);
+
+    /// Receive data to a freshly allocated data vector, pulling from the remote site if necessary
+    std::vector<uint8_t> receive();
+
+    /// Receive to a specific memory region with at last maxSize
+    size_t receive(void *whereTo, size_t maxSize);
+
+    /// Pull all published data from the remote site, as far as the local receive ring has space for it.
+    /// Returns the number of pulled bytes
+    size_t pull();
+
+    /// Pull from multiple connections at once, overlapping the round trips of all of them
+    static void pullAll(const std::vector<RDMAPullMessageBuffer *> &buffers);
+
+    /// Construct a message buffer of the given size, exchanging RDMA networking information over the given socket
+    /// size _must_ be a power of 2.
+    RDMAPullMessageBuffer(size_t size, int sock);
+
+    /// whether there is an already pulled message to be read non-blockingly
+    bool hasData() const;
+
+private:
+    const size_t size;
+    RDMANetworking net;
+    std::unique_ptr<uint8_t[]> sendBuffer;
+    std::atomic<size_t> sendPos{0};
+    volatile size_t currentRemotePulled = 0;
+    std::unique_ptr<uint8_t[]> receiveBuffer;
+    size_t readPos = 0;
+    std::atomic<size_t> pulledPos{0};
+    volatile size_t currentRemoteSendPos = 0;
+    size_t pendingPull = 0;
+    rdma::MemoryRegion localSend;
+    rdma::MemoryRegion localSendPos;
+    rdma::MemoryRegion localCurrentRemotePulled;
+    rdma::MemoryRegion localReceive;
+    rdma::MemoryRegion localPulledPos;
+    rdma::MemoryRegion localCurrentRemoteSendPos;
+    rdma::RemoteMemoryRegion remoteSend;
+    rdma::RemoteMemoryRegion remoteSendPos;
+    rdma::RemoteMemoryRegion remotePulledPos;
+
+    void writeToSendBuffer(size_t writePos, const uint8_t *data, size_t sizeToWrite);
+
+    void readFromReceiveBuffer(size_t readPos, uint8_t *whereTo, size_t sizeToRead) const;
+
+    /// Size of the next message, if it has been pulled completely
+    bool nextMessageSize(size_t &messageSize) const;
+
+    void postSendPosRead();
+
+    void postDataRead();
+
+    void finishDataRead();
+
+    void waitForRead(uint64_t id);
+};
+
+#endif //RDMA_HASH_MAP_RDMAPULLMESSAGEBUFFER_H
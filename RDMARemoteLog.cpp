@@ -0,0 +1,161 @@
+#include "RDMARemoteLog.h"
+#include <algorithm>
+#include "rdma/WorkRequest.hpp"
+#include "tcpWrapper.h"
+#include "wraparound.h"
+
+using namespace std;
+using namespace rdma;
+
+static const uint64_t writeId = 1;
+static const uint64_t commitId = 2;
+static const uint64_t releasedReadId = 3;
+/// Every so often, a log write is signaled, so the send queue doesn't overflow without commits
+static const size_t signalInterval = 4096;
+
+struct LogInfo {
+    uint32_t logKey;
+    uint32_t positionsKey;
+    uintptr_t logAddress;
+    uintptr_t commitPosAddress;
+    uintptr_t releasedPosAddress;
+    uint64_t logSize;
+};
+
+RDMALogFollower::RDMALogFollower(int sock, size_t logSize) :
+        size(logSize),
+        net(sock),
+        positions(new(allocatePages(sizeof(Positions))) Positions()),
+        log(static_cast<volatile uint8_t *>(allocatePages(logSize))),
+        localPositions(positions.get(), sizeof(Positions), net.network.getProtectionDomain(),
+                       MemoryRegion::Permission::LocalWrite | MemoryRegion::Permission::RemoteWrite |
+                       MemoryRegion::Permission::RemoteRead),
+        localLog(const_cast<uint8_t *>(log.get()), logSize, net.network.getProtectionDomain(),
+                 MemoryRegion::Permission::LocalWrite | MemoryRegion::Permission::RemoteWrite) {
+    if ((logSize & (logSize - 1)) != 0) {
+        throw runtime_error{"logSize should be a power of 2"};
+    }
+
+    LogInfo info{};
+    info.logKey = localLog.key->rkey;
+    info.logAddress = reinterpret_cast<uintptr_t>(localLog.address);
+    info.positionsKey = localPositions.key->rkey;
+    info.commitPosAddress = reinterpret_cast<uintptr_t>(&positions->commitPos);
+    info.releasedPosAddress = reinterpret_cast<uintptr_t>(&positions->releasedPos);
+    info.logSize = logSize;
+    tcp_write(sock, &info, sizeof(info));
+}
+
+uint64_t RDMALogFollower::commitPosition() const {
+    const uint64_t commitPos = positions->commitPos;
+    // The log is written before the commit position, don't read it any earlier
+    atomic_thread_fence(memory_order_acquire);
+    return commitPos;
+}
+
+uint64_t RDMALogFollower::waitForCommit(uint64_t pos) const {
+    uint64_t commitPos;
+    while ((commitPos = commitPosition()) <= pos);
+    return commitPos;
+}
+
+void RDMALogFollower::peek(uint64_t pos, const uint8_t *&data, size_t &length) const {
+    const auto commitPos = commitPosition();
+    if (pos < positions->releasedPos || pos > commitPos) throw runtime_error{"not in the committed log"};
+
+    const size_t begin = pos & (size - 1);
+    length = min<size_t>(commitPos - pos, size - begin);
+    data = const_cast<const uint8_t *>(log.get()) + begin;
+}
+
+void RDMALogFollower::read(uint64_t pos, uint8_t *whereTo, size_t length) const {
+    checkCommitted(pos, length);
+    wraparound(log.get(), size, length, pos, [&](size_t prevBytes, volatile uint8_t *begin, volatile uint8_t *end) {
+        copy(begin, end, whereTo + prevBytes);
+    });
+}
+
+void RDMALogFollower::release(uint64_t pos) {
+    const uint64_t releasedPos = positions->releasedPos;
+    if (pos < releasedPos) throw runtime_error{"already released"};
+    checkCommitted(releasedPos, pos - releasedPos);
+    positions->releasedPos.store(pos, memory_order_release);
+}
+
+void RDMALogFollower::checkCommitted(uint64_t pos, size_t length) const {
+    if (pos < positions->releasedPos || pos + length > commitPosition()) {
+        throw runtime_error{"not in the committed log"};
+    }
+}
+
+RDMALogLeader::RDMALogLeader(int sock) :
+        net(sock),
+        positions(new(allocatePages(sizeof(Positions))) Positions()),
+        localPositions(positions.get(), sizeof(Positions), net.network.getProtectionDomain(),
+                       MemoryRegion::Permission::LocalWrite) {
+    LogInfo info{};
+    tcp_read(sock, &info, sizeof(info));
+    size = info.logSize;
+    remoteLog = RemoteMemoryRegion(info.logAddress, info.logKey);
+    remoteCommitPos = RemoteMemoryRegion(info.commitPosAddress, info.positionsKey);
+    remoteReleasedPos = RemoteMemoryRegion(info.releasedPosAddress, info.positionsKey);
+
+    mirror = unique_ptr<uint8_t[], PageDeleter>(static_cast<uint8_t *>(allocatePages(size)));
+    localMirror = make_unique<MemoryRegion>(mirror.get(), size, net.network.getProtectionDomain(),
+                                            MemoryRegion::Permission::LocalWrite);
+}
+
+uint64_t RDMALogLeader::append(const uint8_t *data, size_t length) {
+    if (length > size) throw runtime_error{"data bigger than the log"};
+    waitForSpace(length);
+
+    wraparound(size, length, appendPos, [&](size_t prevBytes, size_t beginPos, size_t endPos) {
+        copy(data + prevBytes, data + prevBytes + (endPos - beginPos), mirror.get() + beginPos);
+
+        WriteWorkRequest write;
+        write.setLocalAddress(localMirror->slice(beginPos, endPos - beginPos));
+        write.setRemoteAddress(remoteLog.slice(beginPos));
+        const bool signaled = ++unsignaledWrites == signalInterval;
+        write.setCompletion(signaled);
+        write.setId(writeId);
+        net.queuePair.postWorkRequest(write);
+        if (signaled) {
+            waitFor(writeId);
+            unsignaledWrites = 0;
+        }
+    });
+    appendPos += length;
+    return appendPos;
+}
+
+void RDMALogLeader::commit() {
+    if (positions->commitPos == appendPos) {
+        return;
+    }
+    // The queue pair executes the writes in order, so the commit position arrives after the log it covers
+    positions->commitPos = appendPos;
+    WriteWorkRequest write;
+    write.setLocalAddress(localPositions.slice(offsetof(Positions, commitPos), sizeof(uint64_t)));
+    write.setRemoteAddress(remoteCommitPos);
+    write.setCompletion(true);
+    write.setId(commitId);
+    net.queuePair.postWorkRequest(write);
+    waitFor(commitId);
+    unsignaledWrites = 0;
+}
+
+void RDMALogLeader::waitForSpace(size_t length) {
+    while (appendPos + length - positions->releasedPos > size) {
+        ReadWorkRequest read;
+        read.setLocalAddress(localPositions.slice(offsetof(Positions, releasedPos), sizeof(uint64_t)));
+        read.setRemoteAddress(remoteReleasedPos);
+        read.setCompletion(true);
+        read.setId(releasedReadId);
+        net.queuePair.postWorkRequest(read);
+        waitFor(releasedReadId);
+    }
+}
+
+void RDMALogLeader::waitFor(uint64_t id) {
+    while (net.completionQueue.pollSendCompletionQueue() != id);
+}
@@ -0,0 +1,91 @@
+#ifndef RDMA_HASH_MAP_RDMAREMOTELOG_H
+#define RDMA_HASH_MAP_RDMAREMOTELOG_H
+
+#include <atomic>
+#include "RDMAMessageBuffer.h"
+
+/// Receiving side of a replicated, append only log, e.g. a WAL. The leader (RDMALogLeader) writes the records directly
+/// into the registered log and publishes how far it is valid with the commit position. There is no framing and no
+/// receive processing per record, the follower applies everything up to the commit position and releases it again.
+/// Positions grow monotonically, the log itself is a ring of logSize bytes.
+class RDMALogFollower {
+public:
+    /// Connect to the leader, which creates its RDMALogLeader for the same socket. logSize _must_ be a power of 2
+    RDMALogFollower(int sock, size_t logSize);
+
+    /// Everything before this position has been written completely by the leader
+    uint64_t commitPosition() const;
+
+    /// Spin until the commit position is behind the given position and return it
+    uint64_t waitForCommit(uint64_t pos) const;
+
+    /// Zero copy access to the committed log at the given position, up to the commit position or the end of the ring.
+    /// It stays valid, until it is released
+    void peek(uint64_t pos, const uint8_t *&data, size_t &length) const;
+
+    /// Copy committed parts of the log
+    void read(uint64_t pos, uint8_t *whereTo, size_t length) const;
+
+    /// Everything before the given position has been applied, so the leader can overwrite it. Positions only move
+    /// forward, releasing behind the current release position throws
+    void release(uint64_t pos);
+
+private:
+    /// Positions accessed by the leader
+    struct Positions {
+        volatile uint64_t commitPos = 0;
+        std::atomic<uint64_t> releasedPos{0};
+    };
+
+    const size_t size;
+    RDMANetworking net;
+    std::unique_ptr<Positions, PageDeleter> positions;
+    std::unique_ptr<volatile uint8_t[], PageDeleter> log;
+    rdma::MemoryRegion localPositions;
+    rdma::MemoryRegion localLog;
+
+    void checkCommitted(uint64_t pos, size_t length) const;
+};
+
+/// Sending side of the replicated log, see RDMALogFollower. The records are copied to a local mirror of the log and
+/// written from there to the same position in the follower's log.
+class RDMALogLeader {
+public:
+    /// Connect to the follower, which creates its RDMALogFollower for the same socket
+    explicit RDMALogLeader(int sock);
+
+    /// Write data to the end of the log, blocks while the follower hasn't released enough space.
+    /// Returns the position behind the data. It isn't visible to the follower, until it is committed
+    uint64_t append(const uint8_t *data, size_t length);
+
+    /// Publish everything appended so far to the follower. Returns, when it arrived in the follower's memory
+    void commit();
+
+    /// The position behind the last append
+    uint64_t position() const { return appendPos; }
+
+private:
+    /// Sources and destinations of the RDMA operations on the follower's positions
+    struct Positions {
+        uint64_t commitPos = 0;
+        volatile uint64_t releasedPos = 0;
+    };
+
+    RDMANetworking net;
+    size_t size = 0;
+    uint64_t appendPos = 0;
+    size_t unsignaledWrites = 0;
+    std::unique_ptr<Positions, PageDeleter> positions;
+    std::unique_ptr<uint8_t[], PageDeleter> mirror;
+    rdma::MemoryRegion localPositions;
+    std::unique_ptr<rdma::MemoryRegion> localMirror;
+    rdma::RemoteMemoryRegion remoteLog;
+    rdma::RemoteMemoryRegion remoteCommitPos;
+    rdma::RemoteMemoryRegion remoteReleasedPos;
+
+    void waitForSpace(size_t length);
+
+    void waitFor(uint64_t id);
+};
+
+#endif //RDMA_HASH_MAP_RDMAREMOTELOG_H
@@ -0,0 +1,174 @@
+#include "RDMARpc.h"
+
+using namespace std;
+using namespace rdma;
+
+RDMARpcServer::RDMARpcServer(size_t bufferSize) : bufferSize(bufferSize) {}
+
+void RDMARpcServer::registerHandler(uint32_t method, Handler handler) {
+    handlers[method] = move(handler);
+}
+
+void RDMARpcServer::addConnection(int sock) {
+    connections.push_back({make_unique<RDMAMessageBuffer>(bufferSize, sock), {}});
+}
+
+size_t RDMARpcServer::poll() {
+    size_t handled = 0;
+    for (auto it = connections.begin(); it != connections.end();) {
+        auto &connection = *it->buffer;
+        auto &pendingResponse = it->pendingResponse;
+        bool closed = false;
+        try {
+            connection.checkConnection();
+            bool full = not pendingResponse.empty() && not tryStage(connection, pendingResponse);
+            if (not full) {
+                pendingResponse.clear();
+            }
+            for (size_t i = 0; i < maxBatch && not full && connection.hasData(); ++i) {
+                const uint8_t *message;
+                size_t length;
+                if (connection.peek(message, length)) {
+                    if (message == nullptr) {
+                        closed = true;
+                        break;
+                    }
+                    handle(message, length, connection.maxStageSize());
+                    connection.release();
+                } else {
+                    request = connection.receive();
+                    handle(request.data(), request.size(), connection.maxStageSize());
+                }
+                ++handled;
+                // Continue with the next connection, until the client made space for the response
+                if (not tryStage(connection, response)) {
+                    pendingResponse = response;
+                    full = true;
+                }
+            }
+            // The responses of this round are written with a single work request
+            connection.flush();
+            if (closed) {
+                connection.shutdown();
+                connection.close();
+            }
+        } catch (const exception &) {
+            // The connection broke or the client sent a malformed request
+            closed = true;
+        }
+        it = closed ? connections.erase(it) : it + 1;
+    }
+    return handled;
+}
+
+void RDMARpcServer::run(const atomic<bool> &stop) {
+    while (not stop) {
+        poll();
+    }
+}
+
+void RDMARpcServer::handle(const uint8_t *message, size_t length, size_t maxSize) {
+    if (length < sizeof(RpcHeader)) throw runtime_error{"request without header"};
+    RpcHeader header;
+    memcpy(&header, message, sizeof(header));
+
+    response.resize(sizeof(RpcHeader));
+    auto handler = handlers.find(header.method);
+    if (handler == handlers.end()) {
+        header.status = RpcStatus::UnknownMethod;
+    } else {
+        try {
+            handler->second(message + sizeof(RpcHeader), length - sizeof(RpcHeader), response);
+            header.status = RpcStatus::Ok;
+            // The client is still waiting for an answer, so a response, which can't be sent, fails the request
+            if (response.size() > maxSize) throw runtime_error{"response > buffersize!"};
+        } catch (const NetworkException &) {
+            throw;
+        } catch (const exception &e) {
+            const auto reason = e.what();
+            response.resize(sizeof(RpcHeader));
+            response.insert(response.end(), reason, reason + min(strlen(reason), maxSize - sizeof(RpcHeader)));
+            header.status = RpcStatus::HandlerFailed;
+        }
+    }
+    memcpy(response.data(), &header, sizeof(header));
+}
+
+bool RDMARpcServer::tryStage(RDMAMessageBuffer &connection, const vector<uint8_t> &message) {
+    if (message.size() > connection.maxStageSize()) throw runtime_error{"data > buffersize!"};
+    if (not connection.waitForStageSpace(message.size(), chrono::steady_clock::now())) {
+        return false;
+    }
+    connection.stage(message.data(), message.size());
+    return true;
+}
+
+RDMARpcClient::RDMARpcClient(int sock, size_t bufferSize) : buffer(bufferSize, sock) {}
+
+RDMARpcClient::~RDMARpcClient() {
+    try {
+        buffer.shutdown();
+        buffer.close();
+    } catch (const NetworkException &) {
+        // The server is gone already
+    }
+}
+
+uint64_t RDMARpcClient::callAsync(uint32_t method, const uint8_t *data, size_t length) {
+    if (sizeof(RpcHeader) + length > buffer.maxStageSize()) throw runtime_error{"data > buffersize!"};
+    RpcHeader header{};
+    header.requestId = nextRequestId++;
+    header.method = method;
+    header.status = RpcStatus::Ok;
+
+    request.resize(sizeof(RpcHeader) + length);
+    memcpy(request.data(), &header, sizeof(header));
+    if (length != 0) {
+        memcpy(request.data() + sizeof(RpcHeader), data, length);
+    }
+    // The server doesn't take further requests, while its responses don't fit into our ring
+    while (not buffer.waitForStageSpace(request.size(), chrono::steady_clock::now())) {
+        while (buffer.hasData()) {
+            receiveResponse();
+        }
+    }
+    buffer.stage(request.data(), request.size());
+    return header.requestId;
+}
+
+void RDMARpcClient::flush() {
+    buffer.flush();
+}
+
+vector<uint8_t> RDMARpcClient::wait(uint64_t requestId) {
+    flush();
+    auto it = completed.find(requestId);
+    while (it == completed.end()) {
+        if (receiveResponse() == requestId) {
+            it = completed.find(requestId);
+        }
+    }
+
+    auto response = move(it->second);
+    completed.erase(it);
+    switch (response.status) {
+        case RpcStatus::Ok:
+            return move(response.payload);
+        case RpcStatus::UnknownMethod:
+            throw runtime_error{"unknown method"};
+        default:
+            throw runtime_error{string(response.payload.begin(), response.payload.end())};
+    }
+}
+
+uint64_t RDMARpcClient::receiveResponse() {
+    auto message = buffer.receive();
+    if (message.empty()) throw runtime_error{"the server shut down"};
+    if (message.size() < sizeof(RpcHeader)) throw runtime_error{"response without header"};
+
+    RpcHeader header;
+    memcpy(&header, message.data(), sizeof(header));
+    message.erase(message.begin(), message.begin() + sizeof(RpcHeader));
+    completed.emplace(header.requestId, Response{header.status, move(message)});
+    return header.requestId;
+}
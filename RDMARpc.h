@@ -0,0 +1,137 @@
+#ifndef RDMA_HASH_MAP_RDMARPC_H
+#define RDMA_HASH_MAP_RDMARPC_H
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "RDMAMessageBuffer.h"
+
+enum class RpcStatus : uint32_t {
+    Ok,
+    UnknownMethod,
+    /// The handler threw or its response didn't fit into the ring, the payload is the message of the exception
+    HandlerFailed,
+};
+
+/// Prepended to every request and response message
+struct RpcHeader {
+    uint64_t requestId;
+    uint32_t method;
+    RpcStatus status;
+};
+
+/// Dispatches requests of many RDMARpcClients to handlers, by polling all of their rings. The responses are written
+/// directly into the ring of the client.
+class RDMARpcServer {
+public:
+    /// Gets the payload of a request and appends the payload of the response
+    using Handler = std::function<void(const uint8_t *request, size_t length, std::vector<uint8_t> &response)>;
+
+    explicit RDMARpcServer(size_t bufferSize = 64 * 1024);
+
+    void registerHandler(uint32_t method, Handler handler);
+
+    /// Handler for requests and responses, which are plain structs
+    template<typename Request, typename Response>
+    void registerHandler(uint32_t method, std::function<Response(const Request &)> handler) {
+        static_assert(std::is_trivially_copyable<Request>::value, "requests are copied bytewise");
+        static_assert(std::is_trivially_copyable<Response>::value, "responses are copied bytewise");
+        registerHandler(method, [handler](const uint8_t *request, size_t length, std::vector<uint8_t> &response) {
+            if (length != sizeof(Request)) throw std::runtime_error{"request has the wrong size"};
+            Request typedRequest;
+            std::memcpy(&typedRequest, request, sizeof(Request));
+            const Response typedResponse = handler(typedRequest);
+            const auto bytes = reinterpret_cast<const uint8_t *>(&typedResponse);
+            response.insert(response.end(), bytes, bytes + sizeof(Response));
+        });
+    }
+
+    /// Connect a client (RDMARpcClient) over the given socket
+    void addConnection(int sock);
+
+    /// Handle the requests, which are already there. Returns how many were handled
+    size_t poll();
+
+    /// poll() until stop is set
+    void run(const std::atomic<bool> &stop);
+
+    size_t connectionCount() const { return connections.size(); }
+
+private:
+    /// Requests handled per connection and round, before the responses are flushed and the next connection is served
+    static const size_t maxBatch = 32;
+
+    struct Connection {
+        std::unique_ptr<RDMAMessageBuffer> buffer;
+        /// A response, which didn't fit into the ring yet. No further requests are handled, until it is staged
+        std::vector<uint8_t> pendingResponse;
+    };
+
+    const size_t bufferSize;
+    std::unordered_map<uint32_t, Handler> handlers;
+    std::vector<Connection> connections;
+    std::vector<uint8_t> request;
+    std::vector<uint8_t> response;
+
+    /// Build the response to the request in response. A response bigger than maxSize fails the request
+    void handle(const uint8_t *message, size_t length, size_t maxSize);
+
+    /// Stage the response, if the ring has space for it right now. A client, which doesn't receive its responses,
+    /// mustn't block the server
+    static bool tryStage(RDMAMessageBuffer &connection, const std::vector<uint8_t> &message);
+};
+
+/// Client of an RDMARpcServer. Many requests can be outstanding, their responses are matched by the request id
+class RDMARpcClient {
+public:
+    /// Connect to the server, which called RDMARpcServer::addConnection() for the same socket. Both sides need the
+    /// same bufferSize
+    explicit RDMARpcClient(int sock, size_t bufferSize = 64 * 1024);
+
+    ~RDMARpcClient();
+
+    /// Copy a request to the ring and return its id. Requests are written together by the next flush() or wait().
+    /// While the ring is full, arriving responses are received, so the server can continue
+    uint64_t callAsync(uint32_t method, const uint8_t *request, size_t length);
+
+    void flush();
+
+    /// Wait for the response of the request. Throws a runtime_error, if the server couldn't handle it
+    std::vector<uint8_t> wait(uint64_t requestId);
+
+    std::vector<uint8_t> call(uint32_t method, const uint8_t *request, size_t length) {
+        return wait(callAsync(method, request, length));
+    }
+
+    /// Call a handler for plain structs, see RDMARpcServer::registerHandler()
+    template<typename Response, typename Request>
+    Response call(uint32_t method, const Request &request) {
+        static_assert(std::is_trivially_copyable<Request>::value, "requests are copied bytewise");
+        static_assert(std::is_trivially_copyable<Response>::value, "responses are copied bytewise");
+        const auto bytes = call(method, reinterpret_cast<const uint8_t *>(&request), sizeof(Request));
+        if (bytes.size() != sizeof(Response)) throw std::runtime_error{"response has the wrong size"};
+        Response response;
+        std::memcpy(&response, bytes.data(), sizeof(Response));
+        return response;
+    }
+
+private:
+    struct Response {
+        RpcStatus status;
+        std::vector<uint8_t> payload;
+    };
+
+    RDMAMessageBuffer buffer;
+    uint64_t nextRequestId = 1;
+    /// Responses, which arrived while waiting for another one or for space in the ring
+    std::unordered_map<uint64_t, Response> completed;
+    std::vector<uint8_t> request;
+
+    /// Receive the next response to completed and return its request id
+    uint64_t receiveResponse();
+};
+
+#endif //RDMA_HASH_MAP_RDMARPC_H
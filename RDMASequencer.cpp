@@ -0,0 +1,79 @@
+#include "RDMASequencer.h"
+#include <algorithm>
+#include "rdma/WorkRequest.hpp"
+#include "tcpWrapper.h"
+
+using namespace std;
+using namespace rdma;
+
+static const uint64_t fetchAndAddId = 1;
+
+struct SequencerInfo {
+    uint32_t key;
+    uintptr_t address;
+    uint64_t counterCount;
+};
+
+RDMASequencer::RDMASequencer(size_t counterCount) :
+        counterCount(counterCount),
+        counters(static_cast<uint64_t *>(allocatePages(counterCount * sizeof(uint64_t)))),
+        localCounters(counters.get(), counterCount * sizeof(uint64_t), network.getProtectionDomain(),
+                      MemoryRegion::Permission::LocalWrite | MemoryRegion::Permission::RemoteRead |
+                      MemoryRegion::Permission::RemoteAtomic) {
+    if (counterCount == 0) {
+        throw runtime_error{"the sequencer needs at least one counter"};
+    }
+    fill(counters.get(), counters.get() + counterCount, 0);
+}
+
+void RDMASequencer::accept(int sock) {
+    clients.push_back(make_unique<RDMANetworking>(sock, 1, &network));
+
+    SequencerInfo info{};
+    info.key = localCounters.key->rkey;
+    info.address = reinterpret_cast<uintptr_t>(localCounters.address);
+    info.counterCount = counterCount;
+    tcp_write(sock, &info, sizeof(info));
+}
+
+uint64_t RDMASequencer::peek(size_t counter) const {
+    if (counter >= counterCount) throw runtime_error{"no such counter"};
+    return reinterpret_cast<volatile uint64_t *>(counters.get())[counter];
+}
+
+RDMASequencerClient::RDMASequencerClient(int sock, uint64_t rangeSize) :
+        net(sock),
+        rangeSize(rangeSize),
+        previousValue(static_cast<uint64_t *>(allocatePages(sizeof(uint64_t)))),
+        localPreviousValue(previousValue.get(), sizeof(uint64_t), net.network.getProtectionDomain(),
+                           MemoryRegion::Permission::LocalWrite) {
+    if (rangeSize == 0) throw runtime_error{"ranges need at least one ID"};
+
+    SequencerInfo info{};
+    tcp_read(sock, &info, sizeof(info));
+    remoteCounters = RemoteMemoryRegion(info.address, info.key);
+    cache.resize(info.counterCount);
+}
+
+uint64_t RDMASequencerClient::next(size_t counter) {
+    if (counter >= cache.size()) throw runtime_error{"no such counter"};
+
+    auto &range = cache[counter];
+    if (range.next == range.end) {
+        range.next = reserve(counter, rangeSize);
+        range.end = range.next + rangeSize;
+    }
+    return range.next++;
+}
+
+uint64_t RDMASequencerClient::reserve(size_t counter, uint64_t count) {
+    if (counter >= cache.size()) throw runtime_error{"no such counter"};
+
+    auto fetchAndAdd = AtomicFetchAndAddWorkRequestBuilder(localPreviousValue,
+                                                           remoteCounters.slice(counter * sizeof(uint64_t)), count,
+                                                           true).build();
+    fetchAndAdd.setId(fetchAndAddId);
+    net.queuePair.postWorkRequest(fetchAndAdd);
+    while (net.completionQueue.pollSendCompletionQueue() != fetchAndAddId);
+    return *previousValue;
+}
@@ -0,0 +1,57 @@
+#ifndef RDMA_HASH_MAP_RDMASEQUENCER_H
+#define RDMA_HASH_MAP_RDMASEQUENCER_H
+
+#include <vector>
+#include "RDMAMessageBuffer.h"
+
+/// Counters in registered memory, which clients (RDMASequencerClient) increment with remote fetch and adds, e.g. to
+/// hand out transaction IDs. Like RDMAHashTable, the CPU of the server is only needed to connect new clients.
+class RDMASequencer {
+public:
+    explicit RDMASequencer(size_t counterCount);
+
+    /// Connect a client (RDMASequencerClient) over the given socket
+    void accept(int sock);
+
+    /// The next value of the counter, which hasn't been handed out yet. Only a snapshot, while clients are connected
+    uint64_t peek(size_t counter) const;
+
+private:
+    const size_t counterCount;
+    rdma::Network network;
+    std::unique_ptr<uint64_t[], PageDeleter> counters;
+    rdma::MemoryRegion localCounters;
+    std::vector<std::unique_ptr<RDMANetworking>> clients;
+};
+
+/// Client of an RDMASequencer. next() reserves rangeSize IDs at once with a single fetch and add and hands them out
+/// from its cache, so the round trip is only paid once per range.
+/// IDs are unique across all clients and increasing for each client. With a rangeSize of 1, they are also handed out in
+/// global order, bigger ranges trade this for throughput.
+class RDMASequencerClient {
+public:
+    /// Connect to the sequencer, whose server called RDMASequencer::accept() for the same socket
+    RDMASequencerClient(int sock, uint64_t rangeSize);
+
+    /// The next ID of the counter, from the cached range or a newly reserved one
+    uint64_t next(size_t counter = 0);
+
+    /// Reserve count consecutive IDs, bypassing the cache. Returns the first of them
+    uint64_t reserve(size_t counter, uint64_t count);
+
+private:
+    struct Range {
+        uint64_t next = 0;
+        uint64_t end = 0;
+    };
+
+    RDMANetworking net;
+    const uint64_t rangeSize;
+    rdma::RemoteMemoryRegion remoteCounters;
+    std::vector<Range> cache;
+    /// Registered memory for the results of the fetch and adds
+    std::unique_ptr<uint64_t, PageDeleter> previousValue;
+    rdma::MemoryRegion localPreviousValue;
+};
+
+#endif //RDMA_HASH_MAP_RDMASEQUENCER_H
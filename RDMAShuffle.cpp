@@ -0,0 +1,268 @@
+#include "RDMAShuffle.h"
+#include <algorithm>
+#include <cstring>
+#include "rdma/WorkRequest.hpp"
+#include "tcpWrapper.h"
+
+using namespace std;
+using namespace rdma;
+
+// A batch is written as [header][tuples][validity], every tuple as [uint32_t length][data]
+static const uint64_t validity = 0xDEADDEADBEEFBEEF; // arbitrary constant. Just don't use 0
+static const uint64_t lastBatchFlag = uint64_t(1) << 63; // set in the header of the last batch of a peer
+static const size_t signalInterval = 1024; // signaled writes free the send queue of the unsignaled ones before
+static const uint64_t signaledId = 1;
+static const uint64_t bindId = 2;
+
+struct ShuffleInfo {
+    uint32_t slotsKey;
+    uint32_t creditsKey;
+    uintptr_t slotsAddress;
+    uintptr_t creditsAddress;
+    uint64_t batchSize;
+    uint64_t credits;
+};
+
+/// Inbound memory is only written by peers through their memory windows, if there are any
+static MemoryRegion::Permission inboundPermissions(bool useWindows) {
+    return MemoryRegion::Permission::LocalWrite |
+           (useWindows ? MemoryRegion::Permission::MemoryWindowBind : MemoryRegion::Permission::RemoteWrite);
+}
+
+static size_t roundUp(size_t length) {
+    return (length + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+RDMAShuffle::RDMAShuffle(const vector<int> &socks, size_t batchSize, size_t credits) :
+        batchSize(batchSize),
+        credits(credits),
+        useWindows(network.supportsMemoryWindows()),
+        outbox(static_cast<uint8_t *>(allocatePages(socks.size() * credits * batchSize))),
+        inbox(static_cast<volatile uint8_t *>(allocatePages(socks.size() * credits * batchSize))),
+        counters(static_cast<Credits *>(allocatePages(socks.size() * sizeof(Credits)))),
+        localOutbox(outbox.get(), socks.size() * credits * batchSize, network.getProtectionDomain(),
+                    MemoryRegion::Permission::LocalWrite),
+        localInbox(const_cast<uint8_t *>(inbox.get()), socks.size() * credits * batchSize,
+                   network.getProtectionDomain(), inboundPermissions(useWindows)),
+        localCounters(counters.get(), socks.size() * sizeof(Credits), network.getProtectionDomain(),
+                      inboundPermissions(useWindows)) {
+    if (socks.empty()) throw runtime_error{"a shuffle needs peers"};
+    if (credits == 0) throw runtime_error{"a shuffle needs at least one credit"};
+    if (batchSize % sizeof(uint64_t) != 0 || batchSize < 4 * sizeof(uint64_t)) {
+        throw runtime_error{"batchSize should be a multiple of 8 and hold at least one tuple"};
+    }
+
+    peers.resize(socks.size());
+    for (size_t i = 0; i < socks.size(); ++i) {
+        auto &peer = peers[i];
+        // All peers live in the same network, so they can all write from our outbox
+        peer.net = make_unique<RDMANetworking>(socks[i], 1, &network);
+
+        ShuffleInfo info{};
+        info.slotsAddress = reinterpret_cast<uintptr_t>(inboxSlot(i, 0));
+        info.creditsAddress = reinterpret_cast<uintptr_t>(&counters[i].consumedByPeer);
+        if (useWindows) {
+            info.slotsKey = bindWindow(peer, peer.slotsWindow, localInbox,
+                                       localInbox.slice(i * credits * batchSize, credits * batchSize));
+            info.creditsKey = bindWindow(peer, peer.creditsWindow, localCounters,
+                                         localCounters.slice(i * sizeof(Credits) + offsetof(Credits, consumedByPeer),
+                                                             sizeof(uint64_t)));
+        } else {
+            info.slotsKey = localInbox.key->rkey;
+            info.creditsKey = localCounters.key->rkey;
+        }
+        info.batchSize = batchSize;
+        info.credits = credits;
+        tcp_write(socks[i], &info, sizeof(info));
+        tcp_read(socks[i], &info, sizeof(info));
+        if (info.batchSize != batchSize || info.credits != credits) {
+            throw runtime_error{"all nodes of a shuffle need the same batchSize and credits"};
+        }
+        peer.remoteSlots = RemoteMemoryRegion(info.slotsAddress, info.slotsKey);
+        peer.remoteCredits = RemoteMemoryRegion(info.creditsAddress, info.creditsKey);
+    }
+}
+
+void RDMAShuffle::push(size_t destination, const uint8_t *tuple, size_t length) {
+    if (destination >= peers.size()) throw runtime_error{"no such peer"};
+    const size_t sizeToWrite = sizeof(uint32_t) + length;
+    if (sizeToWrite > payloadCapacity()) throw runtime_error{"tuple bigger than a batch"};
+
+    auto &peer = peers[destination];
+    if (peer.fill + sizeToWrite > payloadCapacity()) {
+        sendBatch(destination, false);
+    }
+    acquireSlot(destination);
+
+    auto payload = outboxSlot(destination, peer.sentBatches) + sizeof(uint64_t);
+    const auto tupleLength = static_cast<uint32_t>(length);
+    memcpy(payload + peer.fill, &tupleLength, sizeof(tupleLength));
+    memcpy(payload + peer.fill + sizeof(tupleLength), tuple, length);
+    peer.fill += sizeToWrite;
+}
+
+void RDMAShuffle::flush() {
+    for (size_t i = 0; i < peers.size(); ++i) {
+        if (peers[i].fill != 0) {
+            sendBatch(i, false);
+        }
+    }
+}
+
+void RDMAShuffle::finish() {
+    for (size_t i = 0; i < peers.size(); ++i) {
+        sendBatch(i, true);
+    }
+}
+
+size_t RDMAShuffle::poll(const Consumer &consumer) {
+    size_t tuples = 0;
+    while (not parked.empty()) {
+        auto batch = move(parked.front());
+        parked.pop_front();
+        tuples += forEachTuple(batch.first, batch.second.data(), batch.second.size(), consumer);
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        // Take at most one round of slots from every peer, so a fast sender doesn't starve the others
+        for (size_t batch = 0; batch < credits; ++batch) {
+            const bool taken = takeBatch(i, [&](const uint8_t *payload, size_t length) {
+                tuples += forEachTuple(i, payload, length, consumer);
+            });
+            if (not taken) {
+                break;
+            }
+        }
+    }
+    return tuples;
+}
+
+bool RDMAShuffle::done() const {
+    return parked.empty() && all_of(peers.begin(), peers.end(), [](const Peer &peer) { return peer.finished; });
+}
+
+void RDMAShuffle::receiveAll(const Consumer &consumer) {
+    while (not done()) {
+        poll(consumer);
+    }
+}
+
+size_t RDMAShuffle::payloadCapacity() const {
+    return batchSize - 2 * sizeof(uint64_t);
+}
+
+uint8_t *RDMAShuffle::outboxSlot(size_t peer, size_t batch) {
+    return outbox.get() + (peer * credits + batch % credits) * batchSize;
+}
+
+volatile uint8_t *RDMAShuffle::inboxSlot(size_t peer, size_t batch) {
+    return inbox.get() + (peer * credits + batch % credits) * batchSize;
+}
+
+void RDMAShuffle::acquireSlot(size_t peer) {
+    auto &destination = peers[peer];
+    while (not destination.slotAcquired) {
+        if (destination.sentBatches - counters[peer].consumedByPeer < credits) {
+            destination.slotAcquired = true;
+            break;
+        }
+        // The peer might be waiting for credits from us as well
+        for (size_t i = 0; i < peers.size(); ++i) {
+            takeBatch(i, [&](const uint8_t *payload, size_t length) {
+                parked.emplace_back(i, vector<uint8_t>(payload, payload + length));
+            });
+        }
+    }
+}
+
+void RDMAShuffle::sendBatch(size_t peer, bool last) {
+    acquireSlot(peer);
+    auto &destination = peers[peer];
+
+    const auto slot = outboxSlot(peer, destination.sentBatches);
+    const uint64_t header = destination.fill | (last ? lastBatchFlag : 0);
+    const size_t footerPos = sizeof(uint64_t) + roundUp(destination.fill);
+    memcpy(slot, &header, sizeof(header));
+    memcpy(slot + footerPos, &validity, sizeof(validity));
+
+    const size_t slotOffset = (destination.sentBatches % credits) * batchSize;
+    WriteWorkRequest write;
+    write.setLocalAddress(localOutbox.slice(slot - outbox.get(), footerPos + sizeof(validity)));
+    write.setRemoteAddress(destination.remoteSlots.slice(slotOffset));
+    post(destination, write);
+
+    ++destination.sentBatches;
+    destination.slotAcquired = false;
+    destination.fill = 0;
+}
+
+bool RDMAShuffle::takeBatch(size_t peer, const function<void(const uint8_t *, size_t)> &function) {
+    auto &source = peers[peer];
+    if (source.finished) {
+        return false;
+    }
+    const auto slot = inboxSlot(peer, source.receivedBatches);
+    const uint64_t header = *reinterpret_cast<volatile uint64_t *>(slot);
+    if (header == 0) {
+        return false;
+    }
+    const size_t length = header & ~lastBatchFlag;
+    const size_t footerPos = sizeof(uint64_t) + roundUp(length);
+    // The header arrived, so the rest of the batch is about to arrive as well
+    while (*reinterpret_cast<volatile uint64_t *>(slot + footerPos) != validity);
+
+    function(const_cast<const uint8_t *>(slot + sizeof(uint64_t)), length);
+    source.finished = (header & lastBatchFlag) != 0;
+
+    // Clear the slot for its next batch and return its credit
+    fill(slot, slot + footerPos + sizeof(validity), 0);
+    ++source.receivedBatches;
+    counters[peer].consumed = source.receivedBatches;
+    WriteWorkRequest write;
+    write.setLocalAddress(localCounters.slice(peer * sizeof(Credits) + offsetof(Credits, consumed),
+                                              sizeof(uint64_t)));
+    write.setRemoteAddress(source.remoteCredits);
+    write.setSendInline(true);
+    post(source, write);
+    if (source.finished && source.slotsWindow) {
+        // No more batches follow, so the peer doesn't need access to its slots anymore
+        InvalidateWorkRequest invalidate;
+        invalidate.setWindow(*source.slotsWindow);
+        post(source, invalidate);
+    }
+    return true;
+}
+
+void RDMAShuffle::post(Peer &peer, WorkRequest &workRequest) {
+    const bool signaled = ++peer.unsignaledWrites == signalInterval;
+    workRequest.setCompletion(signaled);
+    workRequest.setId(signaledId);
+    peer.net->queuePair.postWorkRequest(workRequest);
+    if (signaled) {
+        while (peer.net->completionQueue.pollSendCompletionQueue() != signaledId);
+        peer.unsignaledWrites = 0;
+    }
+}
+
+uint32_t RDMAShuffle::bindWindow(Peer &peer, unique_ptr<MemoryWindow> &window, MemoryRegion &region,
+                                 const MemoryRegion::Slice &slice) {
+    window = make_unique<MemoryWindow>(network.getProtectionDomain());
+    BindMemoryWindowWorkRequest bind;
+    bind.setBinding(*window, region, slice, MemoryRegion::Permission::RemoteWrite);
+    bind.setCompletion(true);
+    bind.setId(bindId);
+    peer.net->queuePair.postWorkRequest(bind);
+    while (peer.net->completionQueue.pollSendCompletionQueue() != bindId);
+    return window->rkey;
+}
+
+size_t RDMAShuffle::forEachTuple(size_t source, const uint8_t *payload, size_t length, const Consumer &consumer) {
+    size_t tuples = 0;
+    for (size_t pos = 0; pos < length; ++tuples) {
+        uint32_t tupleLength;
+        memcpy(&tupleLength, payload + pos, sizeof(tupleLength));
+        consumer(source, payload + pos + sizeof(tupleLength), tupleLength);
+        pos += sizeof(tupleLength) + tupleLength;
+    }
+    return tuples;
+}
@@ -0,0 +1,111 @@
+#ifndef RDMA_HASH_MAP_RDMASHUFFLE_H
+#define RDMA_HASH_MAP_RDMASHUFFLE_H
+
+#include <deque>
+#include <functional>
+#include <vector>
+#include "RDMAMessageBuffer.h"
+#include "rdma/MemoryWindow.hpp"
+
+/// All-to-all exchange of tuples between nodes, e.g. to repartition the inputs of a distributed join. Every node
+/// creates a shuffle with connections to all other nodes.
+/// Tuples are collected in a batch per destination, which is written with a single work request into one of the
+/// destination's batch slots for this node. Slots are handed out as credits: a sender only writes into a slot, after
+/// the receiver consumed its previous contents and returned the credit. All connections share one network, so the
+/// receiver drains all of its inbound slots in a single polling loop. Each peer gets a memory window for its own slots,
+/// so it can't write into the slots of the others, which is revoked after the peer's last batch.
+class RDMAShuffle {
+public:
+    using Consumer = std::function<void(size_t source, const uint8_t *tuple, size_t length)>;
+
+    /// Connect to the peers behind the given sockets, which have to create their shuffles with the same parameters.
+    /// Every peer gets `credits` slots of batchSize bytes
+    explicit RDMAShuffle(const std::vector<int> &socks, size_t batchSize = 64 * 1024, size_t credits = 8);
+
+    /// Add a tuple to the batch for the destination peer, which is sent once it's full. While there are no credits to
+    /// send it, inbound batches are copied out of their slots, so all peers can make progress
+    void push(size_t destination, const uint8_t *tuple, size_t length);
+
+    /// Send all batches, which aren't full yet
+    void flush();
+
+    /// Send the remaining batches and tell all peers, that nothing else follows
+    void finish();
+
+    /// Pass all tuples, which have been received, to the consumer. Returns how many there were
+    size_t poll(const Consumer &consumer);
+
+    /// All peers finished and all of their tuples were polled
+    bool done() const;
+
+    /// poll() until done()
+    void receiveAll(const Consumer &consumer);
+
+    size_t peerCount() const { return peers.size(); }
+
+private:
+    struct Peer {
+        std::unique_ptr<RDMANetworking> net;
+        /// Scope the peer's access to its own slots and credit counter, when the device supports memory windows
+        std::unique_ptr<rdma::MemoryWindow> slotsWindow;
+        std::unique_ptr<rdma::MemoryWindow> creditsWindow;
+        rdma::RemoteMemoryRegion remoteSlots;
+        rdma::RemoteMemoryRegion remoteCredits;
+        /// Batches sent to the peer, the current one has the slot sentBatches % credits
+        size_t sentBatches = 0;
+        /// The slot of the current batch is free, i.e. the peer returned its credit
+        bool slotAcquired = false;
+        /// Bytes of tuples in the current batch
+        size_t fill = 0;
+        size_t receivedBatches = 0;
+        bool finished = false;
+        size_t unsignaledWrites = 0;
+    };
+
+    /// Counters in registered memory, one of each per peer
+    struct Credits {
+        /// Written by the peer, how many of our batches it consumed
+        volatile uint64_t consumedByPeer;
+        /// Source for the writes of our own count to the peer
+        uint64_t consumed;
+    };
+
+    const size_t batchSize;
+    const size_t credits;
+    rdma::Network network;
+    /// Otherwise, every peer can write to all inbound slots and counters with the rkeys of their regions
+    const bool useWindows;
+    std::unique_ptr<uint8_t[], PageDeleter> outbox;
+    std::unique_ptr<volatile uint8_t[], PageDeleter> inbox;
+    std::unique_ptr<Credits[], PageDeleter> counters;
+    rdma::MemoryRegion localOutbox;
+    rdma::MemoryRegion localInbox;
+    rdma::MemoryRegion localCounters;
+    std::vector<Peer> peers;
+    /// Inbound batches, which were copied out of their slots while waiting for credits
+    std::deque<std::pair<size_t, std::vector<uint8_t>>> parked;
+
+    size_t payloadCapacity() const;
+
+    uint8_t *outboxSlot(size_t peer, size_t batch);
+
+    volatile uint8_t *inboxSlot(size_t peer, size_t batch);
+
+    void acquireSlot(size_t peer);
+
+    void sendBatch(size_t peer, bool last);
+
+    /// Hand the payload of the next inbound batch of the peer to the function and return its credit.
+    /// Returns false, if it hasn't arrived yet
+    bool takeBatch(size_t peer, const std::function<void(const uint8_t *payload, size_t length)> &function);
+
+    void post(Peer &peer, rdma::WorkRequest &workRequest);
+
+    /// Bind a new window on the queue pair of the peer and return its rkey
+    uint32_t bindWindow(Peer &peer, std::unique_ptr<rdma::MemoryWindow> &window, rdma::MemoryRegion &region,
+                        const rdma::MemoryRegion::Slice &slice);
+
+    static size_t forEachTuple(size_t source, const uint8_t *payload, size_t length, const Consumer &consumer);
+};
+
+#endif //RDMA_HASH_MAP_RDMASHUFFLE_H
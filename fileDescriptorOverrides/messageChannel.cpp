@@ -0,0 +1,59 @@
+#include "messageChannel.h"
+#include <iostream>
+#include <string>
+#include <dlfcn.h>
+
+namespace {
+    const char *const RDMA_MODULE = "libpreloadRDMAVerbs.so";
+
+    using create_channel_t = MessageChannel *(*)(size_t, int, size_t, MessageChannel *, uint8_t);
+    using enable_fork_support_t = void (*)();
+    using probe_device_t = bool (*)();
+
+    create_channel_t createChannel = nullptr;
+    enable_fork_support_t enableForkSupport = nullptr;
+    probe_device_t probeDevice = nullptr;
+
+    /// The module is installed next to the preload library
+    std::string getModulePath() {
+        Dl_info info{};
+        if (dladdr(reinterpret_cast<void *>(&loadRdmaModule), &info) == 0 || info.dli_fname == nullptr) {
+            return RDMA_MODULE;
+        }
+        const std::string ownPath = info.dli_fname;
+        const auto slash = ownPath.rfind('/');
+        return slash == std::string::npos ? RDMA_MODULE : ownPath.substr(0, slash + 1) + RDMA_MODULE;
+    }
+}
+
+bool loadRdmaModule() {
+    static const bool loaded = [] {
+        auto module = dlopen(getModulePath().c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (module == nullptr) {
+            std::cerr << "can't load the RDMA module, staying with TCP: " << dlerror() << std::endl;
+            return false;
+        }
+        createChannel = reinterpret_cast<create_channel_t>(dlsym(module, "rdmaCreateMessageChannel"));
+        enableForkSupport = reinterpret_cast<enable_fork_support_t>(dlsym(module, "rdmaEnableForkSupport"));
+        probeDevice = reinterpret_cast<probe_device_t>(dlsym(module, "rdmaProbeDevice"));
+        if (createChannel == nullptr || enableForkSupport == nullptr || probeDevice == nullptr) {
+            std::cerr << "the RDMA module doesn't fit this preload library, staying with TCP" << std::endl;
+            return false;
+        }
+        return true;
+    }();
+    return loaded;
+}
+
+std::unique_ptr<MessageChannel> createMessageChannel(size_t size, int sock, size_t stripes,
+                                                     MessageChannel *sharedNetwork, uint8_t serviceLevel) {
+    return std::unique_ptr<MessageChannel>(createChannel(size, sock, stripes, sharedNetwork, serviceLevel));
+}
+
+void enableRdmaForkSupport() {
+    enableForkSupport();
+}
+
+bool probeRdmaDevice() {
+    return probeDevice();
+}
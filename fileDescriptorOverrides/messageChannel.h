@@ -0,0 +1,60 @@
+#ifndef MESSAGECHANNEL_H
+#define MESSAGECHANNEL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// The part of RDMAMessageBuffer used by the preload library. The preload library doesn't link against libibverbs,
+/// which is loaded with the RDMA module, when the first connection qualifies for RDMA. So processes without any such
+/// connection don't pay for loading and initializing it.
+/// Errors are reported with rdma::NetworkException, like by RDMAMessageBuffer.
+class MessageChannel {
+public:
+    virtual ~MessageChannel() = default;
+
+    virtual void send(const uint8_t *data, size_t length) = 0;
+
+    virtual size_t receive(void *whereTo, size_t maxSize) = 0;
+
+    virtual void shutdown() = 0;
+
+    virtual bool hasData() const = 0;
+
+    virtual bool remoteShutdown() const = 0;
+
+    virtual void checkConnection() = 0;
+
+    virtual std::vector<uint8_t> fallBackToTcp(int sock) = 0;
+
+    virtual void close() = 0;
+
+    virtual std::chrono::steady_clock::time_point startClose() = 0;
+
+    virtual void finishClose(std::chrono::steady_clock::time_point deadline) = 0;
+
+    virtual void reconnect(int sock, size_t stripes, uint8_t serviceLevel) = 0;
+
+    virtual size_t getSize() const = 0;
+
+    virtual size_t availableBytes() const = 0;
+
+    virtual size_t unreceivedBytes() = 0;
+};
+
+/// Load the RDMA module next to the preload library, returns false if it (or libibverbs) isn't available
+bool loadRdmaModule();
+
+/// See RDMAMessageBuffer. The network of sharedNetwork is used, if given. Needs a loaded RDMA module
+std::unique_ptr<MessageChannel> createMessageChannel(size_t size, int sock, size_t stripes,
+                                                     MessageChannel *sharedNetwork, uint8_t serviceLevel);
+
+/// See rdma::Network::enableForkSupport(). Needs a loaded RDMA module
+void enableRdmaForkSupport();
+
+/// Whether a device can be opened and set up for rdma::Network. Needs a loaded RDMA module
+bool probeRdmaDevice();
+
+#endif //MESSAGECHANNEL_H
@@ -1,35 +1,655 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <arpa/inet.h>
 #include <cstdarg>
 #include <fcntl.h>
 #include <set>
-
-#include "rdma_tests/RDMAMessageBuffer.h"
+#include <pthread.h>
+#include <linux/sockios.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+
+#include "rdma_tests/rdma/Network.hpp"
+#include "rdma_tests/tcpWrapper.h"
+#include "messageChannel.h"
 #include "realFunctions.h"
 #include "overrides.h"
+#include "peerPolicy.h"
 
 namespace {
+    /// The RDMA connection replacing a TCP socket
+    struct Bridge {
+        std::unique_ptr<MessageChannel> messages;
+        /// Small separate lane for MSG_OOB, so urgent data doesn't queue up behind the bulk data
+        std::unique_ptr<MessageChannel> priority;
+        bool readShutdown = false;
+        bool writeShutdown = false;
+        /// After the RDMA connection broke, the stream continues over the TCP socket
+        bool onTcp = false;
+        bool resynchronizing = false;
+        /// poll() noticed, that the RDMA connection broke. The next I/O falls back to TCP
+        bool fallBackPending = false;
+        /// The fallback failed, so the stream can't continue
+        bool broken = false;
+        /// Data received over TCP while waiting for an upgrade, it comes before anything else
+        std::vector<uint8_t> stash;
+        /// Data left in the current frame on the TCP socket
+        uint64_t remainingInFrame = 0;
+        /// The header of the next frame, which may arrive in several parts
+        uint64_t frameHeader = 0;
+        size_t frameHeaderBytes = 0;
+        std::chrono::steady_clock::time_point nextUpgrade;
+        /// This side asked to switch back to RDMA. The remote side expects the setup next, so writes are held back
+        /// until its answer arrives
+        bool upgradeProposed = false;
+        std::vector<uint8_t> heldBack;
+        /// With TCP_CORK, writes are collected and sent as one message, when the socket is uncorked
+        bool corked = false;
+        std::vector<uint8_t> corkedData;
+
+        Bridge(int fd, size_t bufferSize);
+
+        /// Orderly shutdown, afterwards the bridge can be reused for another socket
+        void close();
+
+        void reconnect(int fd);
+    };
+
 // unordered_map does not like to be 0 initialized, so we can't use it here
-    std::map<int, std::unique_ptr<RDMAMessageBuffer>> bridge;
-    std::set<int> rdmableSockets;
-    bool dontCloseRDMA = true; // as long as we can't get rid of the RDMA deallocation errors, don't ever close RDMA connections
-    size_t forkGeneration = 0;
+    // Duplicates of a socket share its bridge, it is closed with the last of them
+    std::map<int, std::shared_ptr<Bridge>> bridge;
+    std::set<int> rdmableSockets; // the handshake is done on the first I/O
+    std::set<int> acceptedSockets; // rdmableSockets, which wait for the decision of the connecting side
+    std::map<std::pair<std::string, uint16_t>, std::chrono::steady_clock::time_point> peersWithoutRdma;
+    std::set<int> inheritedSockets; // bridged in the parent process, unusable after a fork()
+    std::set<int> connectingSockets; // non blocking connect() in progress
+    std::map<int, size_t> requestedBufferSizes; // the biggest SO_SNDBUF / SO_RCVBUF set before the bridge exists
+    // Closed bridges, so servers with many short connections don't register new memory and queue pairs for each
+    std::vector<std::shared_ptr<Bridge>> bridgePool;
 
     const size_t BUFFER_SIZE = 128 * 1024;
+    const size_t MIN_BUFFER_SIZE = 16 * 1024;
+    const size_t MAX_BUFFER_SIZE = 64 * 1024 * 1024;
+    const size_t PRIORITY_BUFFER_SIZE = 4 * 1024;
+    const size_t MAX_POOLED_BRIDGES = 64;
+
+    // After a fallback, the stream on the TCP socket is split in frames, so both sides can agree in-band on switching
+    // back to RDMA. The header of a frame is the length of the data following it, or a control code
+    const uint64_t CONTROL_FRAME = uint64_t(1) << 63;
+    const uint64_t UPGRADE_REQUEST = CONTROL_FRAME | 1;
+    const uint64_t UPGRADE_ACCEPT = CONTROL_FRAME | 2;
+
+    // The handshake at the start of a connection: The accepting side offers RDMA with an urgent byte, the connecting side
+    // always answers it with an urgent decision. Only after a positive one, the accepting side sends the setup magic
+    // in-band and both sides set up the RDMA connection. Urgent data isn't part of the normal stream, so a remote side
+    // without the library doesn't notice it
+    const char OFFER = 'R';
+    const char ACCEPT = 'Y';
+    const char DECLINE = 'N';
+    const char SETUP_MAGIC[] = {'\0', 'R', 'D', 'M', 'A', 'S', 'E', 'T'};
+    // Peers, which didn't take part in the handshake, are only asked again after this
+    const auto NO_RDMA_EXPIRY = std::chrono::seconds(60);
 
     auto getRdmaEnv() {
         static const auto rdmaReachable = getenv("USE_RDMA");
         return rdmaReachable;
     }
 
-    auto getForkGenIntercept() {
-        static const auto forkGenChars = getenv("RDMA_FORKGEN");
-        static const auto forkGen = forkGenChars ? std::stoul(std::string(forkGenChars)) : 0;
-        return forkGen;
+    /// A numeric setting from the environment. Invalid values are reported and replaced by the default, instead of
+    /// failing the I/O, which happens to read it first
+    unsigned long getNumericEnv(const char *name, unsigned long defaultValue, unsigned long min, unsigned long max) {
+        const auto valueChars = getenv(name);
+        if (valueChars == nullptr) {
+            return defaultValue;
+        }
+        const auto savedErrno = errno;
+        errno = 0;
+        char *end = nullptr;
+        const auto value = std::strtoul(valueChars, &end, 10);
+        const bool valid = std::isdigit(valueChars[0]) && *end == '\0' && errno == 0 && value >= min && value <= max;
+        errno = savedErrno;
+        if (not valid) {
+            std::cerr << "ignoring invalid " << name << "=" << valueChars << ", using " << defaultValue << std::endl;
+            return defaultValue;
+        }
+        return value;
+    }
+
+    auto getStripes() {
+        static const auto stripes = getNumericEnv("RDMA_STRIPES", 1, 1, 64);
+        return stripes;
+    }
+
+    auto getProbeTimeout() {
+        static const auto timeout = std::chrono::milliseconds(getNumericEnv("RDMA_PROBE_TIMEOUT", 200, 0, INT32_MAX));
+        return timeout;
+    }
+
+    auto getUpgradeInterval() {
+        static const auto interval = std::chrono::seconds(getNumericEnv("RDMA_UPGRADE_INTERVAL", 10, 0, UINT32_MAX));
+        return interval;
+    }
+
+    auto getPriorityServiceLevel() {
+        // InfiniBand service levels have 4 bits
+        static const auto serviceLevel = getNumericEnv("RDMA_OOB_SL", 0, 0, 15);
+        return static_cast<uint8_t>(serviceLevel);
+    }
+
+    Bridge::Bridge(int fd, size_t bufferSize) :
+            messages(createMessageChannel(bufferSize, fd, getStripes(), nullptr, 0)),
+            priority(createMessageChannel(PRIORITY_BUFFER_SIZE, fd, 1, messages.get(), getPriorityServiceLevel())) {}
+
+    void Bridge::close() {
+        // Both rings wait for their remote side at the same time, so closing takes at most one timeout
+        const auto deadline = messages->startClose();
+        priority->startClose();
+        priority->finishClose(deadline);
+        messages->finishClose(deadline);
+    }
+
+    void Bridge::reconnect(int fd) {
+        messages->reconnect(fd, getStripes(), 0);
+        priority->reconnect(fd, 1, getPriorityServiceLevel());
+        readShutdown = false;
+        writeShutdown = false;
+        onTcp = false;
+        stash.clear();
+        remainingInFrame = 0;
+        frameHeaderBytes = 0;
+        upgradeProposed = false;
+        heldBack.clear();
+        corked = false;
+        corkedData.clear();
+    }
+
+    void forgetBridgesInChild() {
+        // The registered memory of inherited bridges is not mapped in the child, so they can neither be used nor
+        // destroyed properly here. The parent process still owns the RDMA connection
+        for (auto &connection : bridge) {
+            new std::shared_ptr<Bridge>(std::move(connection.second)); // leak it
+            inheritedSockets.insert(connection.first);
+        }
+        bridge.clear();
+        for (auto &pooled : bridgePool) {
+            new std::shared_ptr<Bridge>(std::move(pooled));
+        }
+        bridgePool.clear();
+    }
+
+    /// The ring size this side wants, SO_SNDBUF / SO_RCVBUF rounded up to a power of 2
+    size_t getBufferSize(int fd) {
+        const auto requested = requestedBufferSizes.find(fd);
+        if (requested == requestedBufferSizes.end()) {
+            return BUFFER_SIZE;
+        }
+        size_t bufferSize = MIN_BUFFER_SIZE;
+        while (bufferSize < requested->second && bufferSize < MAX_BUFFER_SIZE) {
+            bufferSize *= 2;
+        }
+        return bufferSize;
+    }
+
+    /// Both rings of a connection have the same size, so both sides use the bigger one of their wishes
+    size_t negotiateBufferSize(int fd) {
+        uint64_t ownSize = getBufferSize(fd);
+        uint64_t remoteSize = 0;
+        tcp_setBlocking(fd);
+        tcp_write(fd, &ownSize, sizeof(ownSize));
+        tcp_read(fd, &remoteSize, sizeof(remoteSize));
+        return std::max(ownSize, remoteSize);
+    }
+
+    /// Whether this process can set up RDMA connections at all. Checked before the handshake, so a missing device or
+    /// fork support is told to the remote side, instead of failing the setup both sides already agreed on
+    bool canUseRdma() {
+        static const bool usable = [] {
+            try {
+                enableRdmaForkSupport();
+            } catch (const std::runtime_error &) {
+                std::cerr << "can't enable fork support for RDMA, staying with TCP" << std::endl;
+                return false;
+            }
+            pthread_atfork(nullptr, nullptr, forgetBridgesInChild);
+            if (not probeRdmaDevice()) {
+                std::cerr << "no usable RDMA device, staying with TCP" << std::endl;
+                return false;
+            }
+            return true;
+        }();
+        return usable;
+    }
+
+    /// Set up the RDMA connection, after both sides agreed on it. Throws std::runtime_error, if that fails
+    void establishBridge(int fd) {
+        rdmableSockets.erase(fd);
+        // The kernel would delay the setup messages, the bridge does the corking from now on
+        int corked = 0;
+        socklen_t corkedLength = sizeof(corked);
+        if (real::getsockopt(fd, IPPROTO_TCP, TCP_CORK, &corked, &corkedLength) == SUCCESS && corked != 0) {
+            const int uncork = 0;
+            real::setsockopt(fd, IPPROTO_TCP, TCP_CORK, &uncork, sizeof(uncork));
+        }
+
+        const auto bufferSize = negotiateBufferSize(fd);
+        auto pooled = std::find_if(bridgePool.begin(), bridgePool.end(), [&](const auto &candidate) {
+            return candidate->messages->getSize() == bufferSize;
+        });
+        std::shared_ptr<Bridge> connection;
+        if (pooled == bridgePool.end()) {
+            connection = std::make_shared<Bridge>(fd, bufferSize);
+        } else {
+            // If reconnecting fails, the bridge isn't pooled again
+            connection = std::move(*pooled);
+            bridgePool.erase(pooled);
+            connection->reconnect(fd);
+        }
+        connection->corked = corked != 0;
+        bridge[fd] = std::move(connection);
+    }
+
+    bool isCorked(int fd) {
+        auto connection = bridge.find(fd);
+        return connection != bridge.end() && connection->second->corked && not connection->second->resynchronizing;
+    }
+
+    /// Send the data collected while the socket was corked as a single message
+    void flushCorked(int fd) {
+        auto connection = bridge.find(fd);
+        if (connection == bridge.end() || connection->second->corkedData.empty() ||
+            connection->second->resynchronizing) {
+            return;
+        }
+        const auto corkedData = std::move(connection->second->corkedData);
+        connection->second->corkedData.clear();
+        const auto corked = connection->second->corked;
+        connection->second->corked = false;
+        write(fd, corkedData.data(), corkedData.size());
+        connection->second->corked = corked;
+    }
+
+    ssize_t writeCorked(int fd, const void *source, size_t requested_bytes) {
+        auto &connection = bridge[fd];
+        if (connection->writeShutdown) {
+            errno = EPIPE;
+            return ERROR;
+        }
+        const auto bytes = reinterpret_cast<const uint8_t *>(source);
+        connection->corkedData.insert(connection->corkedData.end(), bytes, bytes + requested_bytes);
+        // The message needs to fit into the remote ring
+        if (connection->corkedData.size() >= connection->messages->getSize() / 4) {
+            flushCorked(fd);
+        }
+        return requested_bytes;
+    }
+
+    /// A single read(), which retries on EINTR. With wait, a non blocking socket is waited for instead of EAGAIN
+    ssize_t readRetrying(int fd, void *destination, size_t length, bool wait) {
+        for (;;) {
+            const auto received = real::read(fd, destination, length);
+            if (received >= 0) {
+                return received;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (not wait || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                return ERROR;
+            }
+            pollfd pfd{fd, POLLIN, 0};
+            real::poll(&pfd, 1, -1);
+        }
+    }
+
+    /// Read the rest of the next frame header, keeping the part which arrived so far in the bridge, so a header split
+    /// over several reads doesn't lose the framing. Returns 1 once it is complete, 0 at the end of the stream before
+    /// any byte of it, or ERROR with errno set
+    int readFrameHeader(int fd, Bridge &connection, bool wait) {
+        auto bytes = reinterpret_cast<uint8_t *>(&connection.frameHeader);
+        while (connection.frameHeaderBytes < sizeof(connection.frameHeader)) {
+            const auto received = readRetrying(fd, bytes + connection.frameHeaderBytes,
+                                               sizeof(connection.frameHeader) - connection.frameHeaderBytes, wait);
+            if (received < 0) {
+                return ERROR;
+            }
+            if (received == 0) {
+                if (connection.frameHeaderBytes == 0) {
+                    return 0;
+                }
+                errno = ECONNRESET; // The stream ended in the middle of a header
+                return ERROR;
+            }
+            connection.frameHeaderBytes += received;
+        }
+        connection.frameHeaderBytes = 0;
+        return 1;
+    }
+
+    bool sendTcpFrame(int fd, uint64_t header, const void *data, size_t length) {
+        iovec parts[] = {{&header, sizeof(header)}, {const_cast<void *>(data), length}};
+        msghdr message{};
+        message.msg_iov = parts;
+        message.msg_iovlen = length == 0 ? 1 : 2;
+        while (message.msg_iovlen > 0) {
+            const auto sent = real::sendmsg(fd, &message, MSG_NOSIGNAL);
+            if (sent < 0) {
+                return false;
+            }
+            // Skip everything, which has already been sent
+            auto skip = static_cast<size_t>(sent);
+            while (message.msg_iovlen > 0 && skip >= message.msg_iov->iov_len) {
+                skip -= message.msg_iov->iov_len;
+                ++message.msg_iov;
+                --message.msg_iovlen;
+            }
+            if (message.msg_iovlen > 0) {
+                message.msg_iov->iov_base = static_cast<uint8_t *>(message.msg_iov->iov_base) + skip;
+                message.msg_iov->iov_len -= skip;
+            }
+        }
+        return true;
+    }
+
+    size_t readFromStash(Bridge &connection, void *destination, size_t requested_bytes) {
+        const auto toRead = std::min(requested_bytes, connection.stash.size());
+        std::copy(connection.stash.begin(), connection.stash.begin() + toRead,
+                  reinterpret_cast<uint8_t *>(destination));
+        connection.stash.erase(connection.stash.begin(), connection.stash.begin() + toRead);
+        return toRead;
+    }
+
+    /// Move the stream of a broken RDMA connection back to its TCP socket. If the remote side can't be resynchronized,
+    /// the socket is shut down and false returned
+    bool fallBackToTcp(int fd) {
+        auto &connection = bridge[fd];
+        std::cerr << "RDMA connection of socket " << fd << " broke, falling back to TCP" << std::endl;
+        // The resynchronization itself already uses the socket, so don't route it to RDMA
+        connection->onTcp = true;
+        connection->resynchronizing = true;
+        connection->fallBackPending = false;
+        std::vector<uint8_t> unreceived;
+        try {
+            unreceived = connection->messages->fallBackToTcp(fd);
+        } catch (const std::runtime_error &) {
+            // Either the socket is closed as well, or both sides disagree about the stream. Neither can be repaired
+            connection->broken = true;
+        }
+        connection->resynchronizing = false;
+        connection->remainingInFrame = 0;
+        connection->frameHeaderBytes = 0;
+        connection->nextUpgrade = std::chrono::steady_clock::now() + getUpgradeInterval();
+        if (not connection->broken && not unreceived.empty() &&
+            not sendTcpFrame(fd, unreceived.size(), unreceived.data(), unreceived.size())) {
+            connection->broken = true;
+        }
+        if (connection->broken) {
+            std::cerr << "can't resynchronize socket " << fd << ", resetting it" << std::endl;
+            real::shutdown(fd, SHUT_RDWR);
+            return false;
+        }
+        // Shutting down the socket was delayed, so the resynchronization could still use it
+        if (connection->writeShutdown) {
+            real::shutdown(fd, SHUT_WR);
+        }
+        return true;
+    }
+
+    /// Report a connection, whose fallback failed, like a reset socket
+    bool isBroken(const Bridge &connection, int error) {
+        if (connection.broken) {
+            errno = error;
+        }
+        return connection.broken;
     }
 
-    bool isTcpSocket(int socket, bool isServer) {
+    /// Send the writes held back while waiting for the answer to a proposal, over whichever transport is used now
+    void flushHeldBack(int fd) {
+        auto &connection = bridge[fd];
+        const auto heldBack = std::move(connection->heldBack);
+        connection->heldBack.clear();
+        // Every message needs to fit into the remote ring
+        const auto chunkSize = connection->messages->getSize() / 4;
+        for (size_t offset = 0; offset < heldBack.size(); offset += chunkSize) {
+            if (write(fd, heldBack.data() + offset, std::min(chunkSize, heldBack.size() - offset)) < 0) {
+                return;
+            }
+        }
+    }
+
+    /// Switch a fallen back connection to RDMA again, after both sides agreed on it
+    void upgrade(int fd) {
+        auto &connection = bridge[fd];
+        connection->upgradeProposed = false;
+        connection->resynchronizing = true;
+        try {
+            connection->messages->reconnect(fd, getStripes(), 0);
+            // The priority lane most likely broke together with the connection. Both sides reset it in the same order
+            connection->priority->close();
+            connection->priority->reconnect(fd, 1, getPriorityServiceLevel());
+        } catch (const rdma::NetworkException &) {
+            // The remote side notices the broken connection as well, so both sides resynchronize again. If that fails,
+            // the next I/O reports it
+            fallBackToTcp(fd);
+            flushHeldBack(fd);
+            return;
+        }
+        connection->resynchronizing = false;
+        connection->onTcp = false;
+        std::cerr << "RDMA connection of socket " << fd << " is used again" << std::endl;
+        flushHeldBack(fd);
+    }
+
+    bool isUpgradeDue(const Bridge &connection) {
+        return getUpgradeInterval().count() != 0 && std::chrono::steady_clock::now() >= connection.nextUpgrade &&
+               not connection.readShutdown && not connection.writeShutdown && connection.remainingInFrame == 0 &&
+               connection.frameHeaderBytes == 0 &&
+               not connection.messages->hasData();
+    }
+
+    /// Ask the remote side to switch back to RDMA right here in the stream. Its answer is handled by the next read(),
+    /// poll() or a write(), which would otherwise hold back too much
+    void proposeUpgrade(int fd) {
+        auto &connection = bridge[fd];
+        connection->nextUpgrade = std::chrono::steady_clock::now() + getUpgradeInterval();
+        connection->upgradeProposed = sendTcpFrame(fd, UPGRADE_REQUEST, nullptr, 0);
+    }
+
+    /// Handle a control frame read from the socket. Returns whether the connection uses RDMA again
+    bool handleControlFrame(int fd, uint64_t header) {
+        auto &connection = bridge[fd];
+        // When both sides asked at the same time, each request answers the other one
+        if (header == UPGRADE_REQUEST && not connection->upgradeProposed) {
+            sendTcpFrame(fd, UPGRADE_ACCEPT, nullptr, 0);
+        } else if (header != UPGRADE_REQUEST && (header != UPGRADE_ACCEPT || not connection->upgradeProposed)) {
+            return false; // Unknown control frames are skipped
+        }
+        upgrade(fd);
+        return not connection->onTcp;
+    }
+
+    /// Read the stream up to the answer to our proposal, the data before it is stashed. Gives up, when the remote side
+    /// closed the socket, reading it reports that again
+    void receiveUpgradeAnswer(int fd) {
+        auto &connection = bridge[fd];
+        while (connection->upgradeProposed) {
+            if (connection->remainingInFrame == 0) {
+                if (readFrameHeader(fd, *connection, true) <= 0) {
+                    break;
+                }
+                const auto header = connection->frameHeader;
+                if ((header & CONTROL_FRAME) != 0) {
+                    handleControlFrame(fd, header);
+                } else {
+                    connection->remainingInFrame = header;
+                }
+                continue;
+            }
+            // Whatever arrived is kept, even if the stream ends within the frame
+            const auto alreadyStashed = connection->stash.size();
+            const auto toRead = std::min<uint64_t>(connection->remainingInFrame, MIN_BUFFER_SIZE);
+            connection->stash.resize(alreadyStashed + toRead);
+            const auto received = readRetrying(fd, connection->stash.data() + alreadyStashed, toRead, true);
+            connection->stash.resize(alreadyStashed + std::max<ssize_t>(received, 0));
+            if (received <= 0) {
+                break;
+            }
+            connection->remainingInFrame -= received;
+        }
+        connection->upgradeProposed = false;
+    }
+
+    /// Whether a fallen back socket, which poll() reported readable, has data for the application. Control frames
+    /// in front of the data are handled right away
+    bool hasTcpData(int fd) {
+        auto &connection = bridge[fd];
+        while (connection->onTcp && not connection->broken && connection->stash.empty() &&
+               connection->remainingInFrame == 0 && connection->frameHeaderBytes == 0 &&
+               not connection->messages->hasData()) {
+            uint64_t header;
+            // A partial header, the end of the stream or an error are reported like data, read() deals with them
+            if (real::recv(fd, &header, sizeof(header), MSG_PEEK | MSG_DONTWAIT) != sizeof(header) ||
+                (header & CONTROL_FRAME) == 0) {
+                return true;
+            }
+            real::recv(fd, &header, sizeof(header), 0);
+            handleControlFrame(fd, header);
+            pollfd pfd{fd, POLLIN, 0};
+            if (connection->onTcp && real::poll(&pfd, 1, 0) <= 0) {
+                return false;
+            }
+        }
+        if (not connection->onTcp) {
+            // Switched back to RDMA, the data follows in the ring
+            return connection->messages->hasData() || not connection->stash.empty();
+        }
+        return true;
+    }
+
+    void closeBridge(int fd) {
+        auto connection = bridge.find(fd);
+        if (connection == bridge.end()) {
+            return;
+        }
+        // Like the socket itself, the bridge stays open for the remaining duplicates
+        if (connection->second.use_count() > 1) {
+            bridge.erase(connection);
+            return;
+        }
+        flushCorked(fd);
+        // The held back writes go out after the answer
+        if (connection->second->upgradeProposed) {
+            receiveUpgradeAnswer(fd);
+        }
+        auto closing = std::move(connection->second);
+        bridge.erase(connection);
+        if (closing->onTcp) {
+            return; // Its RDMA connection is broken, don't reuse it
+        }
+        try {
+            closing->close();
+        } catch (const rdma::NetworkException &) {
+            return; // Queue pairs which can't be reset aren't reusable, just destroy them
+        }
+        if (bridgePool.size() < MAX_POOLED_BRIDGES) {
+            bridgePool.push_back(std::move(closing));
+        }
+    }
+
+    ssize_t writeOverTcp(int fd, const void *source, size_t requested_bytes) {
+        auto &connection = bridge[fd];
+        if (isBroken(*connection, EPIPE)) {
+            return ERROR;
+        }
+        if (connection->writeShutdown) {
+            errno = EPIPE;
+            return ERROR;
+        }
+        if (not connection->upgradeProposed && isUpgradeDue(*connection)) {
+            proposeUpgrade(fd);
+        }
+        if (connection->upgradeProposed) {
+            const auto bytes = reinterpret_cast<const uint8_t *>(source);
+            connection->heldBack.insert(connection->heldBack.end(), bytes, bytes + requested_bytes);
+            // Like a full socket buffer, the write blocks, until the remote side answered
+            if (connection->heldBack.size() >= connection->messages->getSize()) {
+                receiveUpgradeAnswer(fd);
+            }
+            return requested_bytes;
+        }
+        if (requested_bytes == 0) {
+            return 0;
+        }
+        if (not sendTcpFrame(fd, requested_bytes, source, requested_bytes)) {
+            return ERROR;
+        }
+        return requested_bytes;
+    }
+
+    ssize_t readOverTcp(int fd, void *destination, size_t requested_bytes) {
+        auto &connection = bridge[fd];
+        if (isBroken(*connection, ECONNRESET)) {
+            return ERROR;
+        }
+        if (connection->readShutdown) {
+            return 0;
+        }
+        if (not connection->stash.empty()) {
+            return readFromStash(*connection, destination, requested_bytes);
+        }
+        // Messages received completely before the fallback come first
+        if (connection->messages->hasData()) {
+            return connection->messages->receive(destination, requested_bytes);
+        }
+        if (requested_bytes == 0) {
+            return 0;
+        }
+        while (connection->remainingInFrame == 0) {
+            const auto result = readFrameHeader(fd, *connection, false);
+            if (result <= 0) {
+                return result;
+            }
+            const auto header = connection->frameHeader;
+            if ((header & CONTROL_FRAME) == 0) {
+                connection->remainingInFrame = header;
+            } else if (handleControlFrame(fd, header)) {
+                return read(fd, destination, requested_bytes);
+            }
+        }
+        const auto received = readRetrying(fd, destination, std::min<uint64_t>(requested_bytes,
+                                                                               connection->remainingInFrame), false);
+        if (received == 0) {
+            errno = ECONNRESET; // The stream ended in the middle of a frame
+            return ERROR;
+        }
+        if (received > 0) {
+            connection->remainingInFrame -= received;
+        }
+        return received;
+    }
+
+    /// Whether the socket is currently handled by RDMA
+    bool isBridged(int fd) {
+        auto connection = bridge.find(fd);
+        return connection != bridge.end() && not connection->second->onTcp;
+    }
+
+    bool isInherited(int fd) {
+        if (inheritedSockets.find(fd) == inheritedSockets.end()) {
+            return false;
+        }
+        errno = EIO;
+        return true;
+    }
+
+    bool isTcpSocket(int socket) {
         int socketType;
         {
             socklen_t option;
@@ -44,60 +664,263 @@ namespace {
         {
             struct sockaddr_storage options;
             socklen_t size = sizeof(options);
-            if (isServer) {
-                if (getsockname(socket, reinterpret_cast<struct sockaddr *>(&options), &size) < 0) {
-                    return false;
-                }
-            } else if (getpeername(socket, reinterpret_cast<struct sockaddr *>(&options), &size) < 0) {
+            if (getsockname(socket, reinterpret_cast<struct sockaddr *>(&options), &size) < 0) {
                 return false;
             }
             addressLocation = options.ss_family;
         }
 
-        return socketType == SOCK_STREAM && addressLocation == AF_INET;
+        return socketType == SOCK_STREAM && (addressLocation == AF_INET || addressLocation == AF_INET6);
     }
 
-    sockaddr_in getRDMAReachable() {
-        sockaddr_in possibleAddr{};
-        if (getRdmaEnv() == nullptr) {
-            std::cerr << "USE_RDMA not set, disabling RDMA socket interception" << std::endl;
-            return possibleAddr;
+    const PeerPolicy &getPolicy() {
+        static const PeerPolicy policy(getRdmaEnv(), getenv("RDMA_PORTS"));
+        static const bool checked = [] {
+            if (policy.isEmpty()) {
+                std::cerr << "USE_RDMA not set, disabling RDMA socket interception" << std::endl;
+            }
+            return true;
+        }();
+        (void) checked;
+        return policy;
+    }
+
+    /// The remote address and the service port of a connection, see PeerPolicy
+    bool getPeer(int socket, bool incoming, sockaddr_storage &remoteAddress, uint16_t &servicePort) {
+        sockaddr_storage localAddress{};
+        socklen_t size = sizeof(remoteAddress);
+        if (getpeername(socket, reinterpret_cast<struct sockaddr *>(&remoteAddress), &size) < 0) {
+            return false;
+        }
+        size = sizeof(localAddress);
+        if (getsockname(socket, reinterpret_cast<struct sockaddr *>(&localAddress), &size) < 0) {
+            return false;
         }
+        servicePort = incoming ? getPort(localAddress) : getPort(remoteAddress);
+        return true;
+    }
+
+    std::pair<std::string, uint16_t> getPeerKey(const sockaddr_storage &remoteAddress, uint16_t servicePort) {
+        if (remoteAddress.ss_family == AF_INET6) {
+            const auto &address = reinterpret_cast<const sockaddr_in6 &>(remoteAddress).sin6_addr;
+            return {std::string(reinterpret_cast<const char *>(&address), sizeof(address)), servicePort};
+        }
+        const auto &address = reinterpret_cast<const sockaddr_in &>(remoteAddress).sin_addr;
+        return {std::string(reinterpret_cast<const char *>(&address), sizeof(address)), servicePort};
+    }
 
-        inet_pton(AF_INET, getRdmaEnv(), &possibleAddr.sin_addr);
-        return possibleAddr;
+    bool isKnownWithoutRdma(const sockaddr_storage &remoteAddress, uint16_t servicePort) {
+        const auto peer = peersWithoutRdma.find(getPeerKey(remoteAddress, servicePort));
+        return peer != peersWithoutRdma.end() && std::chrono::steady_clock::now() < peer->second;
     }
 
-    bool shouldServerIntercept(int serverSocket, int clientSocket) {
-        if (not isTcpSocket(serverSocket, true)) {
+    /// The remote side didn't take part in the handshake, so for a while, its connections stay on TCP right away
+    /// instead of waiting for it again
+    void rememberWithoutRdma(int fd, bool incoming) {
+        sockaddr_storage remoteAddress{};
+        uint16_t servicePort;
+        if (not getPeer(fd, incoming, remoteAddress, servicePort)) {
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        for (auto peer = peersWithoutRdma.begin(); peer != peersWithoutRdma.end();) {
+            peer = peer->second <= now ? peersWithoutRdma.erase(peer) : std::next(peer);
+        }
+        peersWithoutRdma[getPeerKey(remoteAddress, servicePort)] = now + NO_RDMA_EXPIRY;
+    }
+
+    bool shouldIntercept(int socket, bool incoming) {
+        if (getPolicy().isEmpty() || not isTcpSocket(socket)) {
             return false;
         }
 
-        const auto possibleAddr = getRDMAReachable();
+        sockaddr_storage remoteAddress{};
+        uint16_t servicePort;
+        if (not getPeer(socket, incoming, remoteAddress, servicePort)) {
+            return false;
+        }
+        // Only now libibverbs is needed, before offering RDMA to the remote side
+        return getPolicy().allows(remoteAddress, servicePort) && not isKnownWithoutRdma(remoteAddress, servicePort) &&
+               loadRdmaModule();
+    }
 
-        sockaddr_in connectedAddr;
-        {
-            socklen_t size = sizeof(connectedAddr);
-            getpeername(clientSocket, reinterpret_cast<struct sockaddr *>(&connectedAddr), &size);
+    /// Wait for an urgent byte of the remote side, a negative timeout waits forever. The library sends it before any
+    /// in-band data, so in-band data arriving first means, that the remote side doesn't take part in the handshake.
+    /// Returns 0 in that case and when the timeout expired
+    char receiveUrgent(int fd, std::chrono::milliseconds timeout) {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        pollfd pfd{fd, POLLPRI | POLLIN, 0};
+        int ready;
+        do {
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+            ready = real::poll(&pfd, 1, timeout.count() < 0 ? -1 : static_cast<int>(std::max<int64_t>(remaining, 0)));
+        } while (ready < 0 && errno == EINTR);
+        if (ready <= 0 || (pfd.revents & POLLPRI) == 0) {
+            return 0;
+        }
+        char urgent = 0;
+        if (real::recv(fd, &urgent, sizeof(urgent), MSG_OOB) != sizeof(urgent)) {
+            return 0;
+        }
+        return urgent;
+    }
+
+    void sendUrgent(int fd, char urgent) {
+        real::send(fd, &urgent, sizeof(urgent), MSG_OOB | MSG_NOSIGNAL);
+    }
+
+    /// After accepting the offer, the accepting side either sends the setup magic, or it already gave up waiting for
+    /// the decision and started the stream over TCP
+    bool receiveSetupMagic(int fd) {
+        char received[sizeof(SETUP_MAGIC)];
+        std::chrono::steady_clock::time_point partialSince{};
+        for (;;) {
+            pollfd pfd{fd, POLLIN, 0};
+            if (real::poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return false;
+            }
+            const auto peeked = real::recv(fd, received, sizeof(received), MSG_PEEK | MSG_DONTWAIT);
+            if (peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            }
+            if (peeked <= 0 || std::memcmp(received, SETUP_MAGIC, static_cast<size_t>(peeked)) != 0) {
+                return false;
+            }
+            if (peeked == sizeof(received)) {
+                return real::recv(fd, received, sizeof(received), 0) == sizeof(received);
+            }
+            // The magic is sent at once, so the rest follows right away. Anything else is the normal stream
+            const auto now = std::chrono::steady_clock::now();
+            if (partialSince == std::chrono::steady_clock::time_point{}) {
+                partialSince = now;
+            } else if (now - partialSince > getProbeTimeout()) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
         }
+    }
 
-        return connectedAddr.sin_addr.s_addr == possibleAddr.sin_addr.s_addr;
+    /// The connecting side waits for the offer and answers it. Returns whether both sides use RDMA
+    bool answerOffer(int fd) {
+        if (not canUseRdma()) {
+            sendUrgent(fd, DECLINE);
+            return false;
+        }
+        if (receiveUrgent(fd, getProbeTimeout()) != OFFER) {
+            // Tell a remote side, whose offer is late, that the stream continues over TCP
+            sendUrgent(fd, DECLINE);
+            rememberWithoutRdma(fd, false);
+            return false;
+        }
+        sendUrgent(fd, ACCEPT);
+        return receiveSetupMagic(fd);
     }
 
-    bool shouldClientIntercept(int socket) {
-        if (not isTcpSocket(socket, false)) {
+    /// The accepting side waits for the decision of the connecting side. A read() can't continue before it anyway,
+    /// a write() only waits for the probe timeout and otherwise starts the stream over TCP
+    bool receiveDecision(int fd, bool reading) {
+        const auto decision = receiveUrgent(fd, reading ? std::chrono::milliseconds(-1) : getProbeTimeout());
+        if (decision == 0) {
+            rememberWithoutRdma(fd, true);
             return false;
         }
+        return decision == ACCEPT &&
+               real::send(fd, SETUP_MAGIC, sizeof(SETUP_MAGIC), MSG_NOSIGNAL) == sizeof(SETUP_MAGIC);
+    }
+
+    bool isSameSocket(int fd, int other) {
+        struct stat fdStat{};
+        struct stat otherStat{};
+        return fstat(fd, &fdStat) == SUCCESS && fstat(other, &otherStat) == SUCCESS &&
+               fdStat.st_dev == otherStat.st_dev && fdStat.st_ino == otherStat.st_ino;
+    }
 
-        const auto possibleAddr = getRDMAReachable();
+    /// Check a non blocking connect(), which might have finished in the meantime
+    void finishConnect(int fd) {
+        if (connectingSockets.find(fd) == connectingSockets.end()) {
+            return;
+        }
+        sockaddr_storage remoteAddress{};
+        socklen_t size = sizeof(remoteAddress);
+        if (getpeername(fd, reinterpret_cast<struct sockaddr *>(&remoteAddress), &size) < 0) {
+            // Still in progress or failed. In the latter case, the application closes the socket anyway
+            return;
+        }
+        connectingSockets.erase(fd);
+        if (shouldIntercept(fd, false)) {
+            rdmableSockets.insert(fd);
+        }
+    }
 
-        sockaddr_in connectedAddr;
-        {
-            socklen_t size = sizeof(connectedAddr);
-            getpeername(socket, reinterpret_cast<struct sockaddr *>(&connectedAddr), &size);
+    /// The RDMA connection is only established on the first I/O, when both sides agreed on it in the handshake
+    void tryEstablishBridge(int fd, bool reading) {
+        rdmableSockets.erase(fd);
+        const bool incoming = acceptedSockets.erase(fd) != 0;
+        bool useRdma = incoming ? receiveDecision(fd, reading) : answerOffer(fd);
+        if (useRdma) {
+            try {
+                establishBridge(fd);
+            } catch (const std::runtime_error &error) {
+                // The remote side is in the middle of the setup as well, so the stream can't continue over TCP
+                // either. The remote side notices the reset and gives up its setup
+                std::cerr << "setting up RDMA for socket " << fd << " failed (" << error.what() << "), resetting it"
+                          << std::endl;
+                real::shutdown(fd, SHUT_RDWR);
+                useRdma = false;
+            }
+        } else {
+            std::cerr << "remote side of socket " << fd << " doesn't use RDMA, staying with TCP" << std::endl;
+        }
+        // Duplicates of the socket were waiting for the same handshake
+        for (auto other = rdmableSockets.begin(); other != rdmableSockets.end();) {
+            if (not isSameSocket(fd, *other)) {
+                ++other;
+                continue;
+            }
+            if (useRdma) {
+                bridge[*other] = bridge[fd];
+            }
+            acceptedSockets.erase(*other);
+            other = rdmableSockets.erase(other);
+        }
+    }
+
+    /// Whether an accepted socket still waits for the decision of the connecting side
+    bool awaitsDecision(int fd) {
+        return acceptedSockets.find(fd) != acceptedSockets.end();
+    }
+
+    /// Forget everything about a file descriptor, which is closed
+    void forgetSocket(int fd) {
+        closeBridge(fd);
+        connectingSockets.erase(fd);
+        requestedBufferSizes.erase(fd);
+        rdmableSockets.erase(fd);
+        acceptedSockets.erase(fd);
+        inheritedSockets.erase(fd);
+    }
+
+    /// A duplicated file descriptor refers to the same socket, so it shares all of its state
+    int duplicate(int fd, int newFd) {
+        if (newFd < 0 || newFd == fd) {
+            return newFd;
         }
+        // dup2() and dup3() close newFd implicitly
+        forgetSocket(newFd);
 
-        return connectedAddr.sin_addr.s_addr == possibleAddr.sin_addr.s_addr;
+        if (bridge.find(fd) != bridge.end()) {
+            bridge[newFd] = bridge[fd];
+        }
+        if (requestedBufferSizes.find(fd) != requestedBufferSizes.end()) {
+            requestedBufferSizes[newFd] = requestedBufferSizes[fd];
+        }
+        for (auto sockets : {&rdmableSockets, &acceptedSockets, &inheritedSockets, &connectingSockets}) {
+            if (sockets->find(fd) != sockets->end()) {
+                sockets->insert(newFd);
+            }
+        }
+        return newFd;
     }
 }
 
@@ -107,74 +930,201 @@ int accept(int server_socket, sockaddr *address, socklen_t *length) {
         return ERROR;
     }
 
-    if (not shouldServerIntercept(server_socket, client_socket)) {
-        return SUCCESS;
+    // Like the kernel buffer sizes, the ring size is inherited from the listening socket
+    const auto requested = requestedBufferSizes.find(server_socket);
+    if (requested != requestedBufferSizes.end()) {
+        requestedBufferSizes[client_socket] = requested->second;
+    }
+
+    // Without a usable device, there is no offer and the connecting side stays on TCP
+    if (not shouldIntercept(client_socket, true) || not canUseRdma()) {
+        return client_socket;
     }
 
+    sendUrgent(client_socket, OFFER);
     rdmableSockets.insert(client_socket);
+    acceptedSockets.insert(client_socket);
     return client_socket;
 }
 
 int connect(int fd, const sockaddr *address, socklen_t length) {
     if (real::connect(fd, address, length) == ERROR) {
-        if (errno != EINPROGRESS) {
-            return ERROR;
-        }
-        // In case of a non blocking socket, we just poll until it is ready...
-        pollfd pfd{fd, POLLOUT, 0};
-        real::poll(&pfd, 1, -1);
-        if ((pfd.revents & POLLERR) != 0) {
-            return ERROR;
+        // A non blocking socket is checked, when the application sees it writable or uses it
+        if (errno == EINPROGRESS) {
+            connectingSockets.insert(fd);
         }
+        return ERROR;
     }
 
-    if (not shouldClientIntercept(fd)) {
-        return SUCCESS;
+    if (shouldIntercept(fd, false)) {
+        rdmableSockets.insert(fd);
     }
-
-    rdmableSockets.insert(fd);
     return SUCCESS;
 }
 
 ssize_t write(int fd, const void *source, size_t requested_bytes) {
-    if (bridge.find(fd) != bridge.end()) {
-        bridge[fd]->send(reinterpret_cast<const uint8_t *>(source), requested_bytes);
+    if (isCorked(fd)) {
+        return writeCorked(fd, source, requested_bytes);
+    }
+    if (isBridged(fd)) {
+        auto &connection = bridge[fd];
+        if (connection->writeShutdown) {
+            errno = EPIPE;
+            return ERROR;
+        }
+        // An empty message would look like the end of the stream to the remote read()
+        if (requested_bytes == 0) {
+            return 0;
+        }
+        if (connection->fallBackPending) {
+            if (not fallBackToTcp(fd)) {
+                errno = EPIPE;
+                return ERROR;
+            }
+            return write(fd, source, requested_bytes);
+        }
+        try {
+            connection->messages->send(reinterpret_cast<const uint8_t *>(source), requested_bytes);
+        } catch (const rdma::NetworkException &) {
+            // The fallback sends everything of the failed message again, which the remote side didn't receive
+            if (not fallBackToTcp(fd)) {
+                errno = EPIPE;
+                return ERROR;
+            }
+        }
         return requested_bytes;
     }
-    if (forkGeneration == getForkGenIntercept() &&
-        // When dealing with the accept then fork pattern, delay the actual RDMA connection to the child process
-        rdmableSockets.find(fd) != rdmableSockets.end()) {
-        rdmableSockets.erase(rdmableSockets.find(fd));
-        bridge[fd] = std::make_unique<RDMAMessageBuffer>(BUFFER_SIZE, fd);
+    if (bridge.find(fd) != bridge.end() && not bridge[fd]->resynchronizing) {
+        return writeOverTcp(fd, source, requested_bytes);
+    }
+    if (isInherited(fd)) {
+        return ERROR;
+    }
+    // Applications on epoll don't tell us, when a non blocking connect() finished
+    finishConnect(fd);
+    // The RDMA connection is only established on the first I/O. With the accept then fork pattern, this happens in
+    // whichever process actually uses the socket
+    if (rdmableSockets.find(fd) != rdmableSockets.end()) {
+        tryEstablishBridge(fd, false);
         return write(fd, source, requested_bytes);
     }
     return real::write(fd, source, requested_bytes);
 }
 
 ssize_t read(int fd, void *destination, size_t requested_bytes) {
-    if (bridge.find(fd) != bridge.end()) {
-        return bridge[fd]->receive(destination, requested_bytes);
+    // The remote side might need the corked data, before it answers
+    flushCorked(fd);
+    if (isBridged(fd)) {
+        auto &connection = bridge[fd];
+        if (connection->readShutdown) {
+            return 0;
+        }
+        if (not connection->stash.empty()) {
+            return readFromStash(*connection, destination, requested_bytes);
+        }
+        try {
+            // Messages, which were received completely, are still in the ring after the fallback
+            if (connection->fallBackPending && not connection->messages->hasData()) {
+                throw rdma::NetworkException("broken connection noticed by poll()");
+            }
+            return connection->messages->receive(destination, requested_bytes);
+        } catch (const rdma::NetworkException &) {
+            if (not fallBackToTcp(fd)) {
+                errno = ECONNRESET;
+                return ERROR;
+            }
+            return read(fd, destination, requested_bytes);
+        }
+    }
+    if (bridge.find(fd) != bridge.end() && not bridge[fd]->resynchronizing) {
+        return readOverTcp(fd, destination, requested_bytes);
     }
 
-    if (forkGeneration == getForkGenIntercept() &&
-        // When dealing with the accept then fork pattern, delay the actual RDMA connection to the child process
-        rdmableSockets.find(fd) != rdmableSockets.end()) {
-        rdmableSockets.erase(rdmableSockets.find(fd));
-        bridge[fd] = std::make_unique<RDMAMessageBuffer>(BUFFER_SIZE, fd);
+    if (isInherited(fd)) {
+        return ERROR;
+    }
+    finishConnect(fd);
+    if (rdmableSockets.find(fd) != rdmableSockets.end()) {
+        tryEstablishBridge(fd, true);
         return read(fd, destination, requested_bytes);
     }
     return real::read(fd, destination, requested_bytes);
 }
 
 int close(int fd) {
-    if (not dontCloseRDMA) {
-        bridge.erase(fd);
-    }
+    forgetSocket(fd);
 
     return real::close(fd);
 }
 
+int dup(int fd) __THROW {
+    return duplicate(fd, real::dup(fd));
+}
+
+int dup2(int fd, int newFd) __THROW {
+    return duplicate(fd, real::dup2(fd, newFd));
+}
+
+int dup3(int fd, int newFd, int flags) __THROW {
+    return duplicate(fd, real::dup3(fd, newFd, flags));
+}
+
+int shutdown(int fd, int how) __THROW {
+    // The remote side might already wait for data, so a pending socket needs its bridge to tell it about the shutdown
+    if (rdmableSockets.find(fd) != rdmableSockets.end()) {
+        tryEstablishBridge(fd, false);
+    }
+    if (bridge.find(fd) != bridge.end()) {
+        flushCorked(fd);
+        auto &connection = bridge[fd];
+        // The end of the stream can't overtake the held back writes
+        if (connection->upgradeProposed && (how == SHUT_WR || how == SHUT_RDWR)) {
+            receiveUpgradeAnswer(fd);
+        }
+        if (how == SHUT_RD || how == SHUT_RDWR) {
+            connection->readShutdown = true;
+        }
+        if (how == SHUT_WR || how == SHUT_RDWR) {
+            connection->writeShutdown = true;
+        }
+        if (isBridged(fd)) {
+            // The socket itself stays open, in case the stream needs to fall back to it later
+            if (how == SHUT_WR || how == SHUT_RDWR) {
+                try {
+                    if (connection->fallBackPending) {
+                        throw rdma::NetworkException("broken connection noticed by poll()");
+                    }
+                    connection->messages->shutdown();
+                } catch (const rdma::NetworkException &) {
+                    // The fallback shuts the socket down, once the resynchronization is done
+                    if (not fallBackToTcp(fd)) {
+                        errno = EPIPE;
+                        return ERROR;
+                    }
+                }
+            }
+            return SUCCESS;
+        }
+    }
+    return real::shutdown(fd, how);
+}
+
 ssize_t send(int fd, const void *buffer, size_t length, int flags) {
+    if ((flags & MSG_OOB) != 0 && bridge.find(fd) != bridge.end()) {
+        auto &priority = bridge[fd]->priority;
+        // The message and its framing need to fit into the priority ring
+        if (length + 2 * sizeof(uint64_t) > priority->getSize()) {
+            errno = EMSGSIZE;
+            return ERROR;
+        }
+        try {
+            priority->send(reinterpret_cast<const uint8_t *>(buffer), length);
+        } catch (const rdma::NetworkException &) {
+            errno = EIO;
+            return ERROR;
+        }
+        return length;
+    }
 // For now: We forward the call to write for a certain set of
 // flags, which we chose to ignore. By putting them here explicitly,
 // we make sure that we only ignore flags, which are not important.
@@ -192,6 +1142,23 @@ ssize_t send(int fd, const void *buffer, size_t length, int flags) {
 }
 
 ssize_t recv(int fd, void *buffer, size_t length, int flags) {
+    if ((flags & MSG_OOB) != 0 && bridge.find(fd) != bridge.end()) {
+        auto &priority = bridge[fd]->priority;
+        // Like a socket without pending urgent data, instead of blocking
+        if (not priority->hasData()) {
+            errno = EINVAL;
+            return ERROR;
+        }
+        try {
+            return priority->receive(buffer, length);
+        } catch (const rdma::NetworkException &) {
+            errno = EIO;
+            return ERROR;
+        } catch (const std::runtime_error &) {
+            errno = EMSGSIZE; // The urgent message doesn't fit into the buffer
+            return ERROR;
+        }
+    }
 #ifdef __APPLE__
     if (flags == 0) {
 #else
@@ -254,15 +1221,6 @@ ssize_t recvfrom(int fd, void *buffer, size_t length, int flags, struct sockaddr
     }
 }
 
-pid_t fork(void) {
-    dontCloseRDMA = true;
-    auto res = real::fork();
-    if (res == 0) {
-        ++forkGeneration;
-    }
-    return res;
-}
-
 int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
     const auto start = std::chrono::steady_clock::now();
     if (nfds == 0) return 0;
@@ -270,7 +1228,9 @@ int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
     int event_count = 0;
     std::vector<size_t> rdma_fds, normal_fds;
     for (nfds_t index = 0; index < nfds; ++index) {
-        if (bridge.find(fds[index].fd) != bridge.end()) {
+        // Waiting for an answer, so the corked data needs to go out
+        flushCorked(fds[index].fd);
+        if (isBridged(fds[index].fd)) {
             rdma_fds.push_back(index);
         } else {
             normal_fds.push_back(index);
@@ -278,40 +1238,104 @@ int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
     }
 
     if (rdma_fds.size() == 0) {
+        // The connecting side only sends data after the accepting side answered its urgent decision, so a server
+        // waiting for the data needs to notice the decision
+        std::vector<std::pair<size_t, short>> deciding;
+        for (nfds_t index = 0; index < nfds; ++index) {
+            if (awaitsDecision(fds[index].fd)) {
+                deciding.emplace_back(index, fds[index].events);
+                fds[index].events |= POLLPRI;
+            }
+        }
         event_count = real::poll(fds, nfds, timeout);
+        bool decided = false;
+        for (const auto &socket : deciding) {
+            const auto index = socket.first;
+            fds[index].events = socket.second;
+            if ((fds[index].revents & POLLPRI) != 0 && awaitsDecision(fds[index].fd)) {
+                tryEstablishBridge(fds[index].fd, true);
+                decided = true;
+            }
+        }
+        // Control frames on fallen back sockets aren't data for the application
+        bool upgraded = false;
+        for (nfds_t index = 0; index < nfds; ++index) {
+            const auto connection = bridge.find(fds[index].fd);
+            if ((fds[index].revents & POLLIN) == 0 || connection == bridge.end() ||
+                connection->second->resynchronizing) {
+                continue;
+            }
+            if (not hasTcpData(fds[index].fd)) {
+                fds[index].revents &= ~POLLIN;
+                if (fds[index].revents == 0) --event_count;
+            }
+            upgraded |= isBridged(fds[index].fd);
+        }
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        // Poll again, when sockets are bridged now or all events were consumed before the timeout
+        if (decided || upgraded || (event_count == 0 && (timeout < 0 || elapsed < timeout))) {
+            return poll(fds, nfds, timeout < 0 ? timeout : static_cast<int>(std::max<int64_t>(timeout - elapsed, 0)));
+        }
+        for (nfds_t index = 0; index < nfds; ++index) {
+            if ((fds[index].revents & (POLLOUT | POLLERR | POLLHUP)) != 0) {
+                finishConnect(fds[index].fd);
+            }
+        }
     } else if (normal_fds.size() == 0) {
+        // This is necessary for repeated calls with the same poll structures
+        // (the kernel probably does this internally first too)
+        for (auto &i : rdma_fds) {
+            fds[i].revents = 0;
+        }
         do {
             // Do a full loop over all FDs
             for (auto &i : rdma_fds) {
-                auto &msgBuf = bridge[fds[i].fd];
-                if (msgBuf->hasData()) {
-                    auto inFlag = fds[i].events & POLLIN;
-                    if (inFlag != 0) ++event_count;
-                    fds[i].revents |= inFlag;
+                auto &connection = bridge[fds[i].fd];
+                // The resynchronization waits for the remote side, which could take longer than the timeout. So the
+                // socket is reported ready, like the kernel does for errors, and the next read() or write() does it
+                if (isBridged(fds[i].fd) && not connection->fallBackPending) {
+                    try {
+                        connection->messages->checkConnection();
+                    } catch (const rdma::NetworkException &) {
+                        connection->fallBackPending = true;
+                    }
                 }
-                auto outFlag = fds[i].events & POLLOUT;
-                if (outFlag != 0) ++event_count;
-                fds[i].revents |= outFlag;
+                if (connection->fallBackPending) {
+                    fds[i].revents |= fds[i].events & (POLLIN | POLLOUT);
+                } else {
+                    if (connection->messages->hasData() || not connection->stash.empty()) {
+                        fds[i].revents |= fds[i].events & POLLIN;
+                    }
+                    // Like TCP: POLLRDHUP after the remote side shut down, POLLHUP when both directions are shut down
+                    if (connection->messages->remoteShutdown()) {
+                        fds[i].revents |= fds[i].events & POLLRDHUP;
+                        if (connection->writeShutdown) {
+                            fds[i].revents |= POLLHUP;
+                        }
+                    }
+                    if (connection->priority->hasData()) {
+                        fds[i].revents |= fds[i].events & POLLPRI;
+                    }
+                    fds[i].revents |= fds[i].events & POLLOUT;
+                }
+                // Like the kernel, poll() returns the number of ready fds, not of their events
+                if (fds[i].revents != 0) ++event_count;
             }
             if (event_count > 0) break;
-        } while (std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() >
+        } while (timeout < 0 ||
+                 std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() <
                  timeout);
     } else {
         std::cerr << "can't do mixed RDMA / TCP yet" << std::endl;
         return ERROR;
     }
 
-    // This is necessary for repeated calls with the same poll structures
-    // (the kernel probably does this internally first too)
-    for (size_t i = 0; i < nfds; ++i) {
-        fds[i].revents = 0;
-    }
-
     return event_count;
 }
 
 static int fcntl_set(int fd, int command, int flags) {
-    if (bridge.find(fd) != bridge.end()) {
+    if (isBridged(fd)) {
         // TODO: actually do something to set our implementation nonblocking here
         return SUCCESS;
     }
@@ -322,7 +1346,7 @@ static int fcntl_set(int fd, int command, int flags) {
 static int fcntl_get(int fd, int command) {
     int flags = real::fcntl_get_flags(fd, command);
 
-    if (bridge.find(fd) != bridge.end()) {
+    if (isBridged(fd)) {
         // First unset the flag, then check if we have it set
         flags &= ~O_NONBLOCK; // TODO: if we fcntl_set set this, we also need to query this
     }
@@ -332,7 +1356,15 @@ static int fcntl_get(int fd, int command) {
 
 
 int fcntl(int fd, int command, ...) {
-    if (bridge.find(fd) != bridge.end()) {
+    if (command == F_DUPFD || command == F_DUPFD_CLOEXEC) {
+        va_list argument;
+        va_start(argument, command);
+        const auto lowestFd = va_arg(argument, int);
+        va_end(argument);
+        return duplicate(fd, real::fcntl_set_flags(fd, command, lowestFd));
+    }
+
+    if (isBridged(fd)) {
         std::cerr << "RDMA fcntl isn't supported!" << std::endl;
         // we can probably support O_NONBLOCK, but just ignore it for now
         return SUCCESS;
@@ -356,18 +1388,88 @@ int fcntl(int fd, int command, ...) {
 }
 
 int getsockopt(int fd, int level, int option_name, void *option_value, socklen_t *option_len) __THROW {
-    return real::getsockopt(fd, level, option_name, option_value, option_len);
+    if (level == IPPROTO_TCP && option_name == TCP_CORK && bridge.find(fd) != bridge.end() &&
+        *option_len >= sizeof(int)) {
+        *reinterpret_cast<int *>(option_value) = bridge[fd]->corked;
+        *option_len = sizeof(int);
+        return SUCCESS;
+    }
+    const auto result = real::getsockopt(fd, level, option_name, option_value, option_len);
+    // Applications ask for SO_ERROR, after a non blocking connect() got writable
+    if (result == SUCCESS && level == SOL_SOCKET && option_name == SO_ERROR) {
+        finishConnect(fd);
+    }
+    return result;
 }
 
 int setsockopt(int fd, int level, int option_name, const void *option_value, socklen_t option_len) __THROW {
-    if (bridge.find(fd) != bridge.end()) {
-        std::cerr << "RDMA setsockopt isn't supported!" << std::endl;
-        // we can probably support O_NONBLOCK
+    if (option_len < sizeof(int)) {
+        return real::setsockopt(fd, level, option_name, option_value, option_len);
+    }
+    const auto value = *reinterpret_cast<const int *>(option_value);
+    const bool hasBridge = bridge.find(fd) != bridge.end();
+
+    // The ring size is chosen, when the bridge is set up. Afterwards, it only affects the socket for a fallback
+    if (level == SOL_SOCKET && (option_name == SO_SNDBUF || option_name == SO_RCVBUF) && not hasBridge &&
+        value > 0) {
+        auto &requested = requestedBufferSizes[fd];
+        requested = std::max(requested, static_cast<size_t>(value));
+    }
+    if (level == IPPROTO_TCP && option_name == TCP_CORK && hasBridge) {
+        bridge[fd]->corked = value != 0;
+        if (value == 0) {
+            flushCorked(fd);
+        }
         return SUCCESS;
     }
+    // Like the kernel, TCP_NODELAY sends everything corked so far
+    if (level == IPPROTO_TCP && option_name == TCP_NODELAY && hasBridge && value != 0) {
+        flushCorked(fd);
+    }
     return real::setsockopt(fd, level, option_name, option_value, option_len);
 }
 
+int ioctl(int fd, unsigned long request, ...) __THROW {
+    va_list argument;
+    va_start(argument, request);
+    const auto value = va_arg(argument, void *);
+    va_end(argument);
+
+    if ((request != FIONREAD && request != SIOCOUTQ) || bridge.find(fd) == bridge.end()) {
+        return real::ioctl(fd, request, value);
+    }
+    auto &connection = bridge[fd];
+    auto &bytes = *reinterpret_cast<int *>(value);
+    int socketBytes = 0;
+    if (connection->onTcp && real::ioctl(fd, request, &socketBytes) == ERROR) {
+        return ERROR;
+    }
+
+    if (request == FIONREAD) {
+        // Over TCP, the frame headers are no data either
+        if (connection->onTcp && connection->remainingInFrame == 0) {
+            const auto missingHeader = sizeof(uint64_t) - connection->frameHeaderBytes;
+            socketBytes = std::max(socketBytes - static_cast<int>(missingHeader), 0);
+        } else if (connection->onTcp) {
+            socketBytes = static_cast<int>(std::min<uint64_t>(socketBytes, connection->remainingInFrame));
+        }
+        bytes = static_cast<int>(connection->stash.size() + connection->messages->availableBytes()) + socketBytes;
+        return SUCCESS;
+    }
+
+    size_t unreceived = connection->corkedData.size() + connection->heldBack.size();
+    if (not connection->onTcp) {
+        try {
+            unreceived += connection->messages->unreceivedBytes();
+        } catch (const rdma::NetworkException &) {
+            errno = EIO;
+            return ERROR;
+        }
+    }
+    bytes = static_cast<int>(unreceived) + socketBytes;
+    return SUCCESS;
+}
+
 // Snip.
 // Select forwarding to poll here. Skip all the way to the bottom
 
@@ -391,7 +1493,8 @@ static void count_rdma_sockets(size_t highest_fd, const DescriptorSets *sets, si
     *rdma_count = 0;
     for (size_t fd = 0; fd < highest_fd; ++fd) {
         if (is_in_any_set(fd, sets)) {
-            if (bridge.find(fd) != bridge.end()) {
+            // poll() notices the decision of the connecting side for sockets in the handshake
+            if (isBridged(fd) || awaitsDecision(fd)) {
                 ++(*rdma_count);
             }
         }
@@ -421,8 +1524,10 @@ select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
             fds[i].events |= POLLOUT;
         }
 
-        if (exceptfds && FD_ISSET(fd, exceptfds))
+        if (exceptfds && FD_ISSET(fd, exceptfds)) {
             fds[i].fd = fd;
+            fds[i].events |= POLLPRI;
+        }
 
         if (fds[i].fd)
             i++;
@@ -480,7 +1585,13 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct
     count_rdma_sockets(nfds, &sets, &rdma_count);
 
     if (rdma_count == 0) {
-        return real::select(nfds, readfds, writefds, errorfds, timeout);
+        const auto result = real::select(nfds, readfds, writefds, errorfds, timeout);
+        for (int fd = 0; result > 0 && fd < nfds; ++fd) {
+            if (fd_is_set(fd, writefds) || fd_is_set(fd, errorfds)) {
+                finishConnect(fd);
+            }
+        }
+        return result;
     }
 
     return forward_to_poll(nfds, &sets, timeout);
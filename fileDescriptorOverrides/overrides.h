@@ -20,6 +20,14 @@ int connect(int fd, const sockaddr *address, socklen_t length);
 
 int close(int fd);
 
+int dup(int fd) __THROW;
+
+int dup2(int fd, int newFd) __THROW;
+
+int dup3(int fd, int newFd, int flags) __THROW;
+
+int shutdown(int fd, int how) __THROW;
+
 ssize_t write(int fd, const void *source, size_t requested_bytes);
 
 ssize_t read(int fd, void *destination, size_t requested_bytes);
@@ -37,8 +45,6 @@ sendto(int fd, const void *buffer, size_t length, int flags, const struct sockad
 
 ssize_t sendmsg(int fd, const struct msghdr *msg, int flags);
 
-pid_t fork(void);
-
 int getsockopt(int fd, int level, int option_name, void *option_value,
                socklen_t *option_len) __THROW; // Mark them as throw in c++ but not in c context
 
@@ -46,6 +52,8 @@ int setsockopt(int fd, int level, int option_name, const void *option_value, soc
 
 int fcntl(int fd, int command, ...);
 
+int ioctl(int fd, unsigned long request, ...) __THROW;
+
 int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout);
 }
 
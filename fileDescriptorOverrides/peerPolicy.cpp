@@ -0,0 +1,147 @@
+#include "peerPolicy.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <arpa/inet.h>
+
+using namespace std;
+
+static vector<string> split(const char *list) {
+    vector<string> result;
+    if (list == nullptr) {
+        return result;
+    }
+    stringstream stream(list);
+    string entry;
+    while (getline(stream, entry, ',')) {
+        entry.erase(remove_if(entry.begin(), entry.end(), [](char c) { return isspace(c); }), entry.end());
+        if (not entry.empty()) {
+            result.push_back(entry);
+        }
+    }
+    return result;
+}
+
+/// Parses a decimal number up to max, without throwing on malformed configurations
+static bool parseNumber(const string &text, unsigned long max, unsigned long &number) {
+    if (text.empty() || not all_of(text.begin(), text.end(), [](char c) { return isdigit(c); })) {
+        return false;
+    }
+    errno = 0;
+    number = strtoul(text.c_str(), nullptr, 10);
+    return errno == 0 && number <= max;
+}
+
+PeerPolicy::PeerPolicy(const char *networkList, const char *portList) {
+    for (const auto &entry : split(networkList)) {
+        const auto slash = entry.find('/');
+        const auto address = entry.substr(0, slash);
+
+        Network network{};
+        if (inet_pton(AF_INET, address.c_str(), network.address) == 1) {
+            network.family = AF_INET;
+            network.prefixLength = 32;
+        } else if (inet_pton(AF_INET6, address.c_str(), network.address) == 1) {
+            network.family = AF_INET6;
+            network.prefixLength = 128;
+        } else {
+            cerr << "ignoring invalid RDMA network " << entry << endl;
+            continue;
+        }
+        if (slash != string::npos) {
+            unsigned long prefixLength;
+            if (not parseNumber(entry.substr(slash + 1), network.prefixLength, prefixLength)) {
+                cerr << "ignoring invalid RDMA network " << entry << endl;
+                continue;
+            }
+            network.prefixLength = static_cast<unsigned>(prefixLength);
+        }
+        networks.push_back(network);
+    }
+
+    for (auto entry : split(portList)) {
+        PortRange range{};
+        range.excluded = entry[0] == '!';
+        if (range.excluded) {
+            entry.erase(0, 1);
+        }
+        const auto dash = entry.find('-');
+        unsigned long first;
+        unsigned long last;
+        if (not parseNumber(entry.substr(0, dash), UINT16_MAX, first) ||
+            not parseNumber(dash == string::npos ? entry : entry.substr(dash + 1), UINT16_MAX, last) || first > last) {
+            cerr << "ignoring invalid RDMA port range " << entry << endl;
+            continue;
+        }
+        range.first = static_cast<uint16_t>(first);
+        range.last = static_cast<uint16_t>(last);
+        hasIncludedPorts |= not range.excluded;
+        ports.push_back(range);
+    }
+}
+
+bool PeerPolicy::allows(const sockaddr_storage &remoteAddress, uint16_t servicePort) const {
+    if (not allowsPort(servicePort)) {
+        return false;
+    }
+
+    if (remoteAddress.ss_family == AF_INET) {
+        const auto &address = reinterpret_cast<const sockaddr_in &>(remoteAddress);
+        return allowsAddress(AF_INET, reinterpret_cast<const uint8_t *>(&address.sin_addr));
+    }
+    if (remoteAddress.ss_family == AF_INET6) {
+        const auto &address = reinterpret_cast<const sockaddr_in6 &>(remoteAddress);
+        // Dual stack sockets see IPv4 peers as ::ffff:a.b.c.d
+        if (IN6_IS_ADDR_V4MAPPED(&address.sin6_addr)) {
+            return allowsAddress(AF_INET, address.sin6_addr.s6_addr + 12);
+        }
+        return allowsAddress(AF_INET6, address.sin6_addr.s6_addr);
+    }
+    return false;
+}
+
+bool PeerPolicy::allowsAddress(sa_family_t family, const uint8_t *address) const {
+    for (const auto &network : networks) {
+        if (network.family != family) {
+            continue;
+        }
+        const auto fullBytes = network.prefixLength / 8;
+        const auto remainingBits = network.prefixLength % 8;
+        if (memcmp(network.address, address, fullBytes) != 0) {
+            continue;
+        }
+        const uint8_t mask = static_cast<uint8_t>(0xFF << (8 - remainingBits));
+        if (remainingBits == 0 || (network.address[fullBytes] & mask) == (address[fullBytes] & mask)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PeerPolicy::allowsPort(uint16_t port) const {
+    bool included = not hasIncludedPorts;
+    for (const auto &range : ports) {
+        if (port < range.first || port > range.last) {
+            continue;
+        }
+        if (range.excluded) {
+            return false;
+        }
+        included = true;
+    }
+    return included;
+}
+
+uint16_t getPort(const sockaddr_storage &address) {
+    if (address.ss_family == AF_INET) {
+        return ntohs(reinterpret_cast<const sockaddr_in &>(address).sin_port);
+    }
+    if (address.ss_family == AF_INET6) {
+        return ntohs(reinterpret_cast<const sockaddr_in6 &>(address).sin6_port);
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef PEERPOLICY_H
+#define PEERPOLICY_H
+
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+
+/// Decides, which TCP connections should be replaced by RDMA. Connections qualify, when the remote address is in one
+/// of the networks and the service port (the remote port for outgoing, the local port for incoming connections)
+/// matches the port rules.
+class PeerPolicy {
+public:
+
+    /// networks: comma separated IPv4 / IPv6 addresses or networks in CIDR notation, e.g. "10.0.0.0/24,fd00::/8,10.1.2.3"
+    /// ports: comma separated ports or port ranges, excluded ones prefixed with '!', e.g. "5432,8000-8100,!8080".
+    /// Without any included ports, all ports not excluded qualify
+    PeerPolicy(const char *networks, const char *ports);
+
+    bool allows(const sockaddr_storage &remoteAddress, uint16_t servicePort) const;
+
+    /// Whether any connection can qualify at all
+    bool isEmpty() const { return networks.empty(); }
+
+private:
+    struct Network {
+        sa_family_t family;
+        uint8_t address[16];
+        unsigned prefixLength;
+    };
+
+    struct PortRange {
+        uint16_t first;
+        uint16_t last;
+        bool excluded;
+    };
+
+    std::vector<Network> networks;
+    std::vector<PortRange> ports;
+    bool hasIncludedPorts = false;
+
+    bool allowsAddress(sa_family_t family, const uint8_t *address) const;
+
+    bool allowsPort(uint16_t port) const;
+};
+
+/// The service port of a connection, see PeerPolicy
+uint16_t getPort(const sockaddr_storage &address);
+
+#endif //PEERPOLICY_H
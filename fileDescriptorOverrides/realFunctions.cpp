@@ -60,6 +60,26 @@ int ::real::close(int fd) {
     return reinterpret_cast<real_close_t>(dlsym(RTLD_NEXT, "close"))(fd);
 }
 
+int ::real::dup(int fd) {
+    using real_dup_t = int (*)(int);
+    return reinterpret_cast<real_dup_t>(dlsym(RTLD_NEXT, "dup"))(fd);
+}
+
+int ::real::dup2(int fd, int newFd) {
+    using real_dup2_t = int (*)(int, int);
+    return reinterpret_cast<real_dup2_t>(dlsym(RTLD_NEXT, "dup2"))(fd, newFd);
+}
+
+int ::real::dup3(int fd, int newFd, int flags) {
+    using real_dup3_t = int (*)(int, int, int);
+    return reinterpret_cast<real_dup3_t>(dlsym(RTLD_NEXT, "dup3"))(fd, newFd, flags);
+}
+
+int ::real::shutdown(int fd, int how) {
+    using real_shutdown_t = int (*)(int, int);
+    return reinterpret_cast<real_shutdown_t>(dlsym(RTLD_NEXT, "shutdown"))(fd, how);
+}
+
 int ::real::getsockopt(int fd, int level, int option_name, void *option_value, socklen_t *option_len) {
     using real_getsockopt_t = int (*)(int, int, int, void *, socklen_t *);
     return (reinterpret_cast<real_getsockopt_t>(dlsym(RTLD_NEXT, "getsockopt")))
@@ -77,11 +97,6 @@ int ::real::poll(struct pollfd fds[], nfds_t nfds, int timeout) {
     return reinterpret_cast<real_poll_t>(dlsym(RTLD_NEXT, "poll"))(fds, nfds, timeout);
 }
 
-int ::real::fork() {
-    using real_fork_t = pid_t (*)();
-    return reinterpret_cast<real_fork_t>(dlsym(RTLD_NEXT, "fork"))();
-}
-
 int ::real::select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout) {
     using real_select_t = int (*)(int, fd_set *, fd_set *, fd_set *, struct timeval *);
     return reinterpret_cast<real_select_t>(dlsym(RTLD_NEXT, "select"))(nfds, readfds, writefds, errorfds, timeout);
@@ -96,3 +111,8 @@ int ::real::fcntl_get_flags(int fd, int command) {
     using real_fcntl_t = int (*)(int, int, ...);
     return reinterpret_cast<real_fcntl_t>(dlsym(RTLD_NEXT, "fcntl"))(fd, command);
 }
+
+int ::real::ioctl(int fd, unsigned long request, void *argument) {
+    using real_ioctl_t = int (*)(int, unsigned long, ...);
+    return reinterpret_cast<real_ioctl_t>(dlsym(RTLD_NEXT, "ioctl"))(fd, request, argument);
+}
@@ -28,6 +28,14 @@ namespace real {
 
     int close(int fd);
 
+    int dup(int fd);
+
+    int dup2(int fd, int newFd);
+
+    int dup3(int fd, int newFd, int flags);
+
+    int shutdown(int fd, int how);
+
     int getsockopt(int fd, int level, int option_name, void *option_value, socklen_t *option_len);
 
     int setsockopt(int fd, int level, int option_name, const void *option_value, socklen_t option_len);
@@ -39,11 +47,11 @@ namespace real {
 
     int fcntl_get_flags(int fd, int command);
 
+    int ioctl(int fd, unsigned long request, void *argument);
+
     int poll(struct pollfd fds[], nfds_t nfds, int timeout);
 
     int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout);
-
-    pid_t fork();
 }
 
 #endif //REALFUNCTIONS_H
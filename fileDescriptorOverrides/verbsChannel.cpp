@@ -0,0 +1,68 @@
+#include "messageChannel.h"
+#include "rdma_tests/RDMAMessageBuffer.h"
+
+// The RDMA module, which is loaded by the preload library with the first connection qualifying for RDMA
+
+namespace {
+    class VerbsChannel : public MessageChannel {
+    public:
+        VerbsChannel(size_t size, int sock, size_t stripes, rdma::Network *sharedNetwork, uint8_t serviceLevel) :
+                buffer(size, sock, stripes, sharedNetwork, serviceLevel) {}
+
+        void send(const uint8_t *data, size_t length) override { buffer.send(data, length); }
+
+        size_t receive(void *whereTo, size_t maxSize) override { return buffer.receive(whereTo, maxSize); }
+
+        void shutdown() override { buffer.shutdown(); }
+
+        bool hasData() const override { return buffer.hasData(); }
+
+        bool remoteShutdown() const override { return buffer.remoteShutdown(); }
+
+        void checkConnection() override { buffer.checkConnection(); }
+
+        std::vector<uint8_t> fallBackToTcp(int sock) override { return buffer.fallBackToTcp(sock); }
+
+        void close() override { buffer.close(); }
+
+        std::chrono::steady_clock::time_point startClose() override { return buffer.startClose(); }
+
+        void finishClose(std::chrono::steady_clock::time_point deadline) override { buffer.finishClose(deadline); }
+
+        void reconnect(int sock, size_t stripes, uint8_t serviceLevel) override {
+            buffer.reconnect(sock, stripes, serviceLevel);
+        }
+
+        size_t getSize() const override { return buffer.getSize(); }
+
+        size_t availableBytes() const override { return buffer.availableBytes(); }
+
+        size_t unreceivedBytes() override { return buffer.unreceivedBytes(); }
+
+        rdma::Network &getNetwork() { return buffer.getNetwork(); }
+
+    private:
+        RDMAMessageBuffer buffer;
+    };
+}
+
+extern "C" {
+MessageChannel *rdmaCreateMessageChannel(size_t size, int sock, size_t stripes, MessageChannel *sharedNetwork,
+                                         uint8_t serviceLevel) {
+    const auto network = sharedNetwork == nullptr ? nullptr : &static_cast<VerbsChannel *>(sharedNetwork)->getNetwork();
+    return new VerbsChannel(size, sock, stripes, network, serviceLevel);
+}
+
+void rdmaEnableForkSupport() {
+    rdma::Network::enableForkSupport();
+}
+
+bool rdmaProbeDevice() {
+    try {
+        rdma::Network network;
+        return true;
+    } catch (const rdma::NetworkException &) {
+        return false;
+    }
+}
+}
@@ -116,13 +116,11 @@ CompletionQueuePair::~CompletionQueuePair()
    if (status != 0) {
       string reason = "destroying the send completion queue failed with error " + to_string(errno) + ": " + strerror(errno);
       cerr << reason << endl;
-      throw NetworkException(reason);
    }
    status = ::ibv_destroy_cq(receiveQueue);
    if (status != 0) {
       string reason = "destroying the receive completion queue failed with error " + to_string(errno) + ": " + strerror(errno);
       cerr << reason << endl;
-      throw NetworkException(reason);
    }
 
    // Destroy the completion channel
@@ -130,7 +128,6 @@ CompletionQueuePair::~CompletionQueuePair()
    if (status != 0) {
       string reason = "destroying the completion channel failed with error " + to_string(errno) + ": " + strerror(errno);
       cerr << reason << endl;
-      throw NetworkException(reason);
    }
 }
 //---------------------------------------------------------------------------
@@ -329,5 +326,15 @@ uint64_t CompletionQueuePair::waitForCompletionReceive()
    return waitForCompletion(true, false).second;
 }
 //---------------------------------------------------------------------------
+void CompletionQueuePair::discardCompletions()
+/// Drop all completions, regardless of their status
+{
+   unique_lock <mutex> lock(guard);
+   ibv_wc completion;
+   while (::ibv_poll_cq(sendQueue, 1, &completion) > 0);
+   while (::ibv_poll_cq(receiveQueue, 1, &completion) > 0);
+   cachedCompletions.clear();
+}
+//---------------------------------------------------------------------------
 } // End of namespace rdma
 //---------------------------------------------------------------------------
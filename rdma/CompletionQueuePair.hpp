@@ -87,6 +87,9 @@ namespace rdma {
         uint64_t waitForCompletionSend();
 
         uint64_t waitForCompletionReceive();
+
+        /// Drop all completions, e.g. the flushed work requests of a disconnected queue pair
+        void discardCompletions();
     };
 //---------------------------------------------------------------------------
 } // End of namespace rdma
@@ -51,13 +51,33 @@ namespace rdma {
                                                                          MemoryRegion::Permission::MemoryWindowBind)) {
             flags |= IBV_ACCESS_MW_BIND;
         }
+        if (static_cast<underlying_type<MemoryRegion::Permission>::type>(permissions &
+                                                                         MemoryRegion::Permission::OnDemand)) {
+            flags |= IBV_ACCESS_ON_DEMAND;
+        }
         return flags;
     }
 
 //---------------------------------------------------------------------------
     MemoryRegion::MemoryRegion(void *address, size_t size, ibv_pd *protectionDomain, Permission permissions) : address(
             address), size(size) {
-        key = ::ibv_reg_mr(protectionDomain, address, size, convertPermissions(permissions));
+        const bool implicit = address == nullptr && size == wholeAddressSpace;
+        if (static_cast<underlying_type<Permission>::type>(permissions & Permission::OnDemand)) {
+            onDemand = supportsOnDemandPaging(protectionDomain, permissions, implicit);
+            if (not onDemand && implicit) {
+                string reason = "the device doesn't support implicit on-demand paging";
+                cerr << reason << endl;
+                throw NetworkException(reason);
+            }
+        }
+
+        const int pinnedFlags = convertPermissions(permissions) & ~IBV_ACCESS_ON_DEMAND;
+        key = ::ibv_reg_mr(protectionDomain, address, size, pinnedFlags | (onDemand ? IBV_ACCESS_ON_DEMAND : 0));
+        if (key == nullptr && onDemand && not implicit) {
+            // Some drivers report the capability, but still refuse the registration
+            onDemand = false;
+            key = ::ibv_reg_mr(protectionDomain, address, size, pinnedFlags);
+        }
         if (key == nullptr) {
             string reason = "registering memory failed with error " + to_string(errno) + ": " + strerror(errno);
             cerr << reason << endl;
@@ -70,7 +90,6 @@ namespace rdma {
         if (::ibv_dereg_mr(key) != 0) {
             string reason = "deregistering memory failed with error " + to_string(errno) + ": " + strerror(errno);
             cerr << reason << endl;
-            throw NetworkException(reason);
         }
     }
 
@@ -78,6 +97,44 @@ namespace rdma {
         return MemoryRegion::Slice(reinterpret_cast<uint8_t *>(address) + offset, size, key->lkey);
     }
 
+//---------------------------------------------------------------------------
+    bool MemoryRegion::prefetch(size_t offset, size_t size, bool forWrite) {
+        if (not onDemand) {
+            return true;
+        }
+        ibv_sge range{};
+        range.addr = reinterpret_cast<uintptr_t>(address) + offset;
+        range.length = size;
+        range.lkey = key->lkey;
+        // Without IBV_ADVISE_MR_FLAG_FLUSH the device faults the pages in asynchronously, the call doesn't block
+        return ::ibv_advise_mr(key->pd, forWrite ? IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE : IBV_ADVISE_MR_ADVICE_PREFETCH,
+                               0, &range, 1) == 0;
+    }
+
+//---------------------------------------------------------------------------
+    bool MemoryRegion::supportsOnDemandPaging(ibv_pd *protectionDomain, Permission permissions, bool implicit) {
+        ibv_device_attr_ex attributes{};
+        if (::ibv_query_device_ex(protectionDomain->context, nullptr, &attributes) != 0) {
+            return false;
+        }
+        const auto &caps = attributes.odp_caps;
+        if (not (caps.general_caps & IBV_ODP_SUPPORT)) {
+            return false;
+        }
+        if (implicit && not (caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT)) {
+            return false;
+        }
+
+        // Local memory is used as the source of sends and writes, remote permissions need the matching operations
+        uint32_t needed = IBV_ODP_SUPPORT_SEND;
+        const int flags = convertPermissions(permissions);
+        if (flags & IBV_ACCESS_LOCAL_WRITE) needed |= IBV_ODP_SUPPORT_RECV;
+        if (flags & IBV_ACCESS_REMOTE_WRITE) needed |= IBV_ODP_SUPPORT_WRITE;
+        if (flags & IBV_ACCESS_REMOTE_READ) needed |= IBV_ODP_SUPPORT_READ;
+        if (flags & IBV_ACCESS_REMOTE_ATOMIC) needed |= IBV_ODP_SUPPORT_ATOMIC;
+        return (caps.per_transport_caps.rc_odp_caps & needed) == needed;
+    }
+
 //---------------------------------------------------------------------------
     ostream &operator<<(ostream &os, const MemoryRegion &memoryRegion) {
         return os << "ptr=" << memoryRegion.address << " size=" << memoryRegion.size << " key={..}";
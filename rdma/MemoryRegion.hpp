@@ -41,6 +41,8 @@ public:
       RemoteRead = 1 << 2,
       RemoteAtomic = 1 << 3,
       MemoryWindowBind = 1 << 4,
+      /// Not a permission: register with on-demand paging instead of pinning the memory, if the device supports it
+      OnDemand = 1 << 5,
       All = LocalWrite | RemoteWrite | RemoteRead | RemoteAtomic | MemoryWindowBind
    };
 
@@ -56,8 +58,11 @@ public:
    ibv_mr *key;
     void *address;
    const size_t size;
+   /// Registered with on-demand paging, the pages are only pinned while the device accesses them
+   bool onDemand = false;
 
-   /// Constructor
+   /// Constructor. With Permission::OnDemand, a nullptr address and the size wholeAddressSpace register the whole
+   /// address space (implicit on-demand paging), otherwise it falls back to pinning the memory
    MemoryRegion(void *address, size_t size, ibv_pd *protectionDomain, Permission permissions);
    /// Destructor
    ~MemoryRegion();
@@ -65,6 +70,15 @@ public:
     /// Get a slice of the memory to pass on
     Slice slice(size_t offset, size_t size);
 
+    /// Start faulting in the pages of an on-demand region before they are accessed, to avoid page faults of the device.
+    /// Doesn't wait for the pages, returns false if the device rejected the advice
+    bool prefetch(size_t offset, size_t size, bool forWrite);
+
+    /// Whether the device supports on-demand paging for the operations allowed by the permissions
+    static bool supportsOnDemandPaging(ibv_pd *protectionDomain, Permission permissions, bool implicit = false);
+
+    static const size_t wholeAddressSpace = SIZE_MAX;
+
    MemoryRegion(MemoryRegion const &) = delete;
    void operator=(MemoryRegion const &) = delete;
 };
@@ -77,6 +91,9 @@ inline MemoryRegion::Permission operator&(MemoryRegion::Permission a, MemoryRegi
    return static_cast<MemoryRegion::Permission>(static_cast<std::underlying_type<MemoryRegion::Permission>::type>(a) & static_cast<std::underlying_type<MemoryRegion::Permission>::type>(b));
 }
 //---------------------------------------------------------------------------
+/// The ibv_access_flags for the permissions
+int convertPermissions(MemoryRegion::Permission permissions);
+//---------------------------------------------------------------------------
 std::ostream &operator<<(std::ostream& os, const MemoryRegion& memoryRegion);
 //---------------------------------------------------------------------------
 } // End of namespace rdma
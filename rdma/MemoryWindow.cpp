@@ -0,0 +1,31 @@
+#include "MemoryWindow.hpp"
+#include "Network.hpp"
+//---------------------------------------------------------------------------
+#include <infiniband/verbs.h>
+#include <iostream>
+#include <cstring>
+//---------------------------------------------------------------------------
+using namespace std;
+//---------------------------------------------------------------------------
+namespace rdma {
+//---------------------------------------------------------------------------
+    MemoryWindow::MemoryWindow(ibv_pd *protectionDomain) {
+        window = ::ibv_alloc_mw(protectionDomain, IBV_MW_TYPE_2);
+        if (window == nullptr) {
+            string reason = "allocating the memory window failed with error " + to_string(errno) + ": " + strerror(errno);
+            cerr << reason << endl;
+            throw NetworkException(reason);
+        }
+        rkey = window->rkey;
+    }
+
+//---------------------------------------------------------------------------
+    MemoryWindow::~MemoryWindow() {
+        if (::ibv_dealloc_mw(window) != 0) {
+            string reason = "deallocating the memory window failed with error " + to_string(errno) + ": " + strerror(errno);
+            cerr << reason << endl;
+        }
+    }
+//---------------------------------------------------------------------------
+} // End of namespace rdma
+//---------------------------------------------------------------------------
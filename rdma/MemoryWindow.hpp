@@ -0,0 +1,31 @@
+#pragma once
+//---------------------------------------------------------------------------
+#include <stdint.h>
+//---------------------------------------------------------------------------
+struct ibv_mw;
+struct ibv_pd;
+//---------------------------------------------------------------------------
+namespace rdma {
+//---------------------------------------------------------------------------
+/// A type 2 memory window: a remotely accessible part of a MemoryRegion with its own rkey. It is bound with a
+/// BindMemoryWindowWorkRequest and then only usable by the queue pair it was bound on, until it is invalidated
+//---------------------------------------------------------------------------
+    class MemoryWindow {
+    public:
+        ibv_mw *window;
+        /// The rkey of the latest binding, every bind generates a new one
+        uint32_t rkey;
+
+        /// Constructor
+        explicit MemoryWindow(ibv_pd *protectionDomain);
+
+        /// Destructor
+        ~MemoryWindow();
+
+        MemoryWindow(MemoryWindow const &) = delete;
+
+        void operator=(MemoryWindow const &) = delete;
+    };
+//---------------------------------------------------------------------------
+} // End of namespace rdma
+//---------------------------------------------------------------------------
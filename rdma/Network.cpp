@@ -21,11 +21,13 @@
 #include "Network.hpp"
 //---------------------------------------------------------------------------
 #include "WorkRequest.hpp"
+#include "MemoryRegion.hpp"
 #include "QueuePair.hpp"
 #include "ReceiveQueue.hpp"
 #include "CompletionQueuePair.hpp"
 //---------------------------------------------------------------------------
 #include <cstring>
+#include <fcntl.h>
 #include <infiniband/verbs.h>
 #include <iostream>
 #include <iomanip>
@@ -82,6 +84,14 @@ Network::Network()
       throw NetworkException(reason);
    }
 
+   // Asynchronous events are only polled, when checking for failures
+   int flags = ::fcntl(context->async_fd, F_GETFL);
+   if (flags < 0 || ::fcntl(context->async_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      string reason = "setting the async event file descriptor non-blocking failed with error " + to_string(errno) + ": " + strerror(errno);
+      cerr << reason << endl;
+      throw NetworkException(reason);
+   }
+
    sharedReceiveQueue = make_unique<ReceiveQueue>(*this);
    sharedCompletionQueuePair = make_unique<CompletionQueuePair>(*this);
 }
@@ -100,7 +110,6 @@ Network::~Network()
         string reason =
                 "deallocating the protection domain failed with error " + to_string(errno) + ": " + strerror(errno);
         cerr << reason << endl;
-        throw NetworkException(reason);
     }
 
     // Close context
@@ -108,7 +117,6 @@ Network::~Network()
     if (status != 0) {
         string reason = "closing the verbs context failed with error " + to_string(errno) + ": " + strerror(errno);
         cerr << reason << endl;
-        throw NetworkException(reason);
     }
 
     // Free devices
@@ -128,6 +136,75 @@ uint16_t Network::getLID()
    return attributes.lid;
 }
 //---------------------------------------------------------------------------
+uint8_t Network::getSubnetTimeout()
+/// Get the subnet timeout of the port
+{
+   struct ibv_port_attr attributes;
+   int status = ::ibv_query_port(context, ibport, &attributes);
+   if (status != 0) {
+      string reason = "querying port " + to_string(ibport) + " failed with error " + to_string(errno) + ": " + strerror(errno);
+      cerr << reason << endl;
+      throw NetworkException(reason);
+   }
+   return attributes.subnet_timeout;
+}
+//---------------------------------------------------------------------------
+bool Network::supportsMemoryWindows()
+/// Whether the device supports type 2 memory windows
+{
+   struct ibv_device_attr attributes;
+   int status = ::ibv_query_device(context, &attributes);
+   if (status != 0) {
+      string reason = "querying the device failed with error " + to_string(status) + ": " + strerror(status);
+      cerr << reason << endl;
+      throw NetworkException(reason);
+   }
+   return attributes.device_cap_flags & (IBV_DEVICE_MEM_WINDOW_TYPE_2A | IBV_DEVICE_MEM_WINDOW_TYPE_2B);
+}
+//---------------------------------------------------------------------------
+bool Network::supportsOnDemandPaging(bool implicit)
+/// Whether the device supports on-demand paging
+{
+   return MemoryRegion::supportsOnDemandPaging(protectionDomain, MemoryRegion::Permission::None, implicit);
+}
+//---------------------------------------------------------------------------
+void Network::handleAsyncEvents()
+/// Poll all pending asynchronous events without blocking
+{
+   ibv_async_event event;
+   while (::ibv_get_async_event(context, &event) == 0) {
+      switch (event.event_type) {
+         case IBV_EVENT_QP_FATAL:
+         case IBV_EVENT_QP_REQ_ERR:
+         case IBV_EVENT_QP_ACCESS_ERR:
+         case IBV_EVENT_PATH_MIG_ERR:
+            failedQueuePairs.insert(event.element.qp->qp_num);
+            break;
+         case IBV_EVENT_PORT_ERR:
+         case IBV_EVENT_DEVICE_FATAL:
+            portFailed = true;
+            break;
+         case IBV_EVENT_PORT_ACTIVE:
+            portFailed = false;
+            break;
+         default:
+            break;
+      }
+      ::ibv_ack_async_event(&event);
+   }
+}
+//---------------------------------------------------------------------------
+void Network::enableForkSupport()
+/// Keep registered memory out of forked children
+{
+   int status = ::ibv_fork_init();
+   if (status != 0) {
+      string reason = "initializing fork support failed with error " + to_string(status) + ": " + strerror(status);
+      cerr << reason << endl;
+      throw NetworkException(reason);
+   }
+}
+//---------------------------------------------------------------------------
 void Network::printCapabilities()
 /// Print the capabilities of the RDMA host channel adapter
 {
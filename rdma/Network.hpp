@@ -21,6 +21,7 @@
 #pragma once
 //---------------------------------------------------------------------------
 #include <mutex>
+#include <set>
 #include <stdexcept>
 #include <vector>
 #include <memory>
@@ -102,6 +103,14 @@ namespace rdma {
         std::unique_ptr<CompletionQueuePair> sharedCompletionQueuePair;
         std::unique_ptr<ReceiveQueue> sharedReceiveQueue;
 
+        /// Queue pairs reported to be broken by asynchronous events
+        std::set<uint32_t> failedQueuePairs;
+        /// Whether the port is down
+        bool portFailed = false;
+
+        /// Handle the pending asynchronous events of the device
+        void handleAsyncEvents();
+
     public:
         /// Constructor
         Network();
@@ -112,11 +121,24 @@ namespace rdma {
         /// Get the LID
         uint16_t getLID();
 
+        /// Get the subnet timeout of the port, the exponent of the time in 4.096us a packet takes through the subnet
+        uint8_t getSubnetTimeout();
+
         /// Get the protection domain
         ibv_pd *getProtectionDomain() { return protectionDomain; }
 
+        /// Whether the device supports type 2 memory windows
+        bool supportsMemoryWindows();
+
+        /// Whether the device supports on-demand paging, implicit covers registering the whole address space
+        bool supportsOnDemandPaging(bool implicit = false);
+
         /// Print the capabilities of the RDMA host channel adapter
         void printCapabilities();
+
+        /// Keep registered memory out of forked children (MADV_DONTFORK), so the parent can keep using it after a
+        /// fork(). Needs to be called before any other RDMA resource is created
+        static void enableForkSupport();
     };
 //---------------------------------------------------------------------------
 }
@@ -24,6 +24,7 @@
 #include "ReceiveQueue.hpp"
 #include "CompletionQueuePair.hpp"
 //---------------------------------------------------------------------------
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <iomanip>
@@ -33,6 +34,14 @@ using namespace std;
 namespace rdma {
 
     static const uint32_t maxInlineSize = 512;
+
+    /// A packet and its ACK need to pass the subnet, so wait at least twice the subnet timeout (4.096us * 2^timeout)
+    static uint8_t ackTimeout(uint8_t subnetTimeout)
+    {
+       const uint8_t minTimeout = 12; // ~16ms, so short subnet timeouts don't cause spurious retransmits
+       const uint8_t maxTimeout = 31;
+       return min(max(static_cast<uint8_t>(subnetTimeout + 1), minTimeout), maxTimeout);
+    }
 //---------------------------------------------------------------------------
 QueuePair::QueuePair(Network &network)
         : QueuePair(network, *network.sharedCompletionQueuePair, *network.sharedReceiveQueue)
@@ -84,7 +93,6 @@ QueuePair::~QueuePair()
    if (status != 0) {
       string reason = "destroying the queue pair failed with error " + to_string(errno) + ": " + strerror(errno);
       cerr << reason << endl;
-      throw NetworkException(reason);
    }
 
    // TODO: free ?
@@ -95,7 +103,7 @@ uint32_t QueuePair::getQPN()
    return qp->qp_num;
 }
 //---------------------------------------------------------------------------
-void QueuePair::connect(const Address &address, unsigned retryCount)
+void QueuePair::connect(const Address &address, unsigned retryCount, uint8_t serviceLevel)
 {
    uint32_t remotePSN = 0;
    uint32_t localPSN = 0;
@@ -124,7 +132,7 @@ void QueuePair::connect(const Address &address, unsigned retryCount)
    attributes.min_rnr_timer = 12;                  // The time before a RNR NACK is sent
    attributes.ah_attr.is_global = 0;               // Whether there is a global routing header
    attributes.ah_attr.dlid = address.lid;          // The LID of the remote host
-   attributes.ah_attr.sl = 0;                      // The service level (which determines the virtual lane)
+   attributes.ah_attr.sl = serviceLevel;           // The service level (which determines the virtual lane)
    attributes.ah_attr.src_path_bits = 0;           // Use the port base LID
    attributes.ah_attr.port_num = network.ibport;   // The local physical port
    if (::ibv_modify_qp(qp, &attributes, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER)) {
@@ -137,7 +145,7 @@ void QueuePair::connect(const Address &address, unsigned retryCount)
    memset(&attributes, 0, sizeof(attributes));
    attributes.qp_state = IBV_QPS_RTS;
    attributes.sq_psn = localPSN;       // The packet sequence number of sent packets
-   attributes.timeout = 0;             // The minimum timeout before retransmitting the packet (0 = infinite)
+   attributes.timeout = ackTimeout(network.getSubnetTimeout()); // The minimum timeout before retransmitting the packet (0 = infinite)
    attributes.retry_cnt = retryCount;  // How often to retry sending (7 = infinite)
    attributes.rnr_retry = retryCount;  // How often to retry sending when RNR NACK was received (7 = infinite)
    attributes.max_rd_atomic = 128;     // The number of outstanding RDMA reads & atomic operations (initiator)
@@ -148,6 +156,38 @@ void QueuePair::connect(const Address &address, unsigned retryCount)
    }
 }
 // -------------------------------------------------------------------------
+void QueuePair::disconnect()
+{
+   struct ibv_qp_attr attributes{};
+
+   // ERR (flushes all outstanding work requests)
+   memset(&attributes, 0, sizeof(attributes));
+   attributes.qp_state = IBV_QPS_ERR;
+   if (::ibv_modify_qp(qp, &attributes, IBV_QP_STATE)) {
+      string reason = "failed to transition QP to ERR state";
+      cerr << reason << endl;
+      throw NetworkException(reason);
+   }
+
+   // RESET (ready to be connected again)
+   memset(&attributes, 0, sizeof(attributes));
+   attributes.qp_state = IBV_QPS_RESET;
+   if (::ibv_modify_qp(qp, &attributes, IBV_QP_STATE)) {
+      string reason = "failed to transition QP to RESET state";
+      cerr << reason << endl;
+      throw NetworkException(reason);
+   }
+
+   // The queue pair number stays the same, so forget about earlier failures
+   network.failedQueuePairs.erase(qp->qp_num);
+}
+// -------------------------------------------------------------------------
+bool QueuePair::hasFailed()
+{
+   network.handleAsyncEvents();
+   return network.portFailed || network.failedQueuePairs.count(qp->qp_num) != 0;
+}
+// -------------------------------------------------------------------------
 void QueuePair::postWorkRequest(const WorkRequest &workRequest)
 {
    ibv_send_wr *badWorkRequest = nullptr;
@@ -61,7 +61,14 @@ namespace rdma {
 
         uint32_t getQPN();
 
-        void connect(const Address &address, unsigned retryCount = 0);
+        /// The serviceLevel selects the virtual lane, higher levels can be prioritized by the fabric
+        void connect(const Address &address, unsigned retryCount = 0, uint8_t serviceLevel = 0);
+
+        /// Flush all outstanding work requests and reset the queue pair, so it can be connected again
+        void disconnect();
+
+        /// Whether the queue pair or its port broke, according to the asynchronous events of the device
+        bool hasFailed();
 
         void postWorkRequest(const WorkRequest &workRequest);
 
@@ -55,7 +55,6 @@ ReceiveQueue::~ReceiveQueue()
    if (status != 0) {
       string reason = "destroying the receive queue failed with error " + to_string(errno) + ": " + strerror(errno);
       cerr << reason << endl;
-      throw NetworkException(reason);
    }
 }
 //---------------------------------------------------------------------------
@@ -304,5 +304,70 @@ namespace rdma {
         wr.setCompletion(completion);
         wr.setAddValue(addValue);
     }
+
+    AtomicCompareAndSwapWorkRequestBuilder::AtomicCompareAndSwapWorkRequestBuilder(
+            const MemoryRegion &localAddress, const RemoteMemoryRegion &remoteAddress, uint64_t compareValue,
+            uint64_t swapValue, bool completion) {
+        wr.setLocalAddress(localAddress);
+        wr.setRemoteAddress(remoteAddress);
+        wr.setCompletion(completion);
+        wr.setCompareValue(compareValue);
+        wr.setSwapValue(swapValue);
+    }
+
+    AtomicCompareAndSwapWorkRequestBuilder::AtomicCompareAndSwapWorkRequestBuilder(
+            const MemoryRegion::Slice &localAddress, const RemoteMemoryRegion &remoteAddress, uint64_t compareValue,
+            uint64_t swapValue, bool completion) {
+        wr.setLocalAddress(localAddress);
+        wr.setRemoteAddress(remoteAddress);
+        wr.setCompletion(completion);
+        wr.setCompareValue(compareValue);
+        wr.setSwapValue(swapValue);
+    }
+
+    void AtomicCompareAndSwapWorkRequestBuilder::send(QueuePair &qp) {
+        qp.postWorkRequest(wr);
+    }
+
+    AtomicCompareAndSwapWorkRequestBuilder &
+    AtomicCompareAndSwapWorkRequestBuilder::setNextWorkRequest(const WorkRequest *workRequest) {
+        wr.setNextWorkRequest(workRequest);
+        return *this;
+    }
+
+    AtomicCompareAndSwapWorkRequest AtomicCompareAndSwapWorkRequestBuilder::build() {
+        return move(wr);
+    }
+
+//---------------------------------------------------------------------------
+    BindMemoryWindowWorkRequest::BindMemoryWindowWorkRequest() {
+        wr->opcode = IBV_WR_BIND_MW;
+        wr->num_sge = 0;
+    }
+
+//---------------------------------------------------------------------------
+    void BindMemoryWindowWorkRequest::setBinding(MemoryWindow &window, const MemoryRegion &region,
+                                                 const MemoryRegion::Slice &slice,
+                                                 MemoryRegion::Permission permissions) {
+        // Only the key part of the rkey changes, so rkeys of previous bindings become invalid
+        window.rkey = ::ibv_inc_rkey(window.rkey);
+        wr->bind_mw.mw = window.window;
+        wr->bind_mw.rkey = window.rkey;
+        wr->bind_mw.bind_info.mr = region.key;
+        wr->bind_mw.bind_info.addr = reinterpret_cast<uintptr_t>(slice.address);
+        wr->bind_mw.bind_info.length = slice.size;
+        wr->bind_mw.bind_info.mw_access_flags = convertPermissions(permissions);
+    }
+
+//---------------------------------------------------------------------------
+    InvalidateWorkRequest::InvalidateWorkRequest() {
+        wr->opcode = IBV_WR_LOCAL_INV;
+        wr->num_sge = 0;
+    }
+
+//---------------------------------------------------------------------------
+    void InvalidateWorkRequest::setWindow(const MemoryWindow &window) {
+        wr->invalidate_rkey = window.rkey;
+    }
 } // End of namespace rdma
 //---------------------------------------------------------------------------
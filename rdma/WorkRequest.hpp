@@ -23,6 +23,7 @@
 #include <memory>
 #include <vector>
 #include "MemoryRegion.hpp"
+#include "MemoryWindow.hpp"
 
 //---------------------------------------------------------------------------
 struct ibv_send_wr;
@@ -213,8 +214,47 @@ namespace rdma {
 
         uint64_t getSwapValue() const;
     };
+
+    class AtomicCompareAndSwapWorkRequestBuilder {
+        AtomicCompareAndSwapWorkRequest wr;
+    public:
+        AtomicCompareAndSwapWorkRequestBuilder(const MemoryRegion &localAddress,
+                                               const RemoteMemoryRegion &remoteAddress, uint64_t compareValue,
+                                               uint64_t swapValue, bool completion);
+
+        AtomicCompareAndSwapWorkRequestBuilder(const MemoryRegion::Slice &localAddress,
+                                               const RemoteMemoryRegion &remoteAddress, uint64_t compareValue,
+                                               uint64_t swapValue, bool completion);
+
+        AtomicCompareAndSwapWorkRequestBuilder &setNextWorkRequest(const WorkRequest *workRequest);
+
+        void send(QueuePair &qp);
+
+        AtomicCompareAndSwapWorkRequest build();
+    };
+//---------------------------------------------------------------------------
+    class BindMemoryWindowWorkRequest : public WorkRequest {
+    public:
+        BindMemoryWindowWorkRequest();
+
+        /// Bind the window to a slice of the region, which needs the MemoryWindowBind permission. The window gets a new
+        /// rkey, which can be handed out once the work request completed
+        void setBinding(MemoryWindow &window, const MemoryRegion &region, const MemoryRegion::Slice &slice,
+                        MemoryRegion::Permission permissions);
+    };
+
+//---------------------------------------------------------------------------
+    class InvalidateWorkRequest : public WorkRequest {
+    public:
+        InvalidateWorkRequest();
+
+        /// Revoke the current rkey of the window, so it can't be accessed remotely anymore
+        void setWindow(const MemoryWindow &window);
+    };
+
 //---------------------------------------------------------------------------
     static_assert(sizeof(rdma::WorkRequest) == sizeof(rdma::AtomicCompareAndSwapWorkRequest), "");
+    static_assert(sizeof(rdma::WorkRequest) == sizeof(rdma::BindMemoryWindowWorkRequest), "");
     static_assert(sizeof(rdma::WorkRequest) == sizeof(rdma::ReadWorkRequest), "");
 
 //---------------------------------------------------------------------------
@@ -0,0 +1,159 @@
+#include "rdmamsg.h"
+#include <cerrno>
+#include <chrono>
+#include <vector>
+#include "RDMAMessageBuffer.h"
+
+using namespace std;
+using namespace rdma;
+
+struct rdmamsg_conn {
+    RDMAMessageBuffer buffer;
+    /// Messages of rdmamsg_recv_zc(), which aren't stored in one piece in the ring
+    vector<uint8_t> scratch;
+    /// A message of rdmamsg_recv_zc() is still in the ring
+    bool peeked = false;
+
+    rdmamsg_conn(int fd, size_t bufferSize, size_t stripes) : buffer(bufferSize, fd, stripes) {}
+};
+
+namespace {
+    /// Exceptions must not cross the C interface, they are reported with errno instead
+    template<typename Result, typename Function>
+    Result guarded(Result error, Function function) {
+        try {
+            return function();
+        } catch (const NetworkException &) {
+            errno = EIO;
+        } catch (const bad_alloc &) {
+            errno = ENOMEM;
+        } catch (const exception &) {
+            errno = EINVAL;
+        }
+        return error;
+    }
+
+    /// Empty messages can't be told apart from the end of the stream on the receiving side
+    bool rejectEmpty(size_t length) {
+        if (length == 0) {
+            errno = EINVAL;
+            return true;
+        }
+        return false;
+    }
+
+    void releasePeeked(rdmamsg_conn *conn) {
+        if (conn->peeked) {
+            conn->buffer.release();
+            conn->peeked = false;
+        }
+    }
+}
+
+int rdmamsg_abi_version(void) {
+    return RDMAMSG_ABI_VERSION;
+}
+
+rdmamsg_conn *rdmamsg_connect_fd(int fd, size_t buffer_size, size_t stripes) {
+    return guarded<rdmamsg_conn *>(nullptr, [&] {
+        return new rdmamsg_conn(fd, buffer_size, stripes);
+    });
+}
+
+int rdmamsg_send(rdmamsg_conn *conn, const void *data, size_t length) {
+    if (rejectEmpty(length)) {
+        return -1;
+    }
+    return guarded(-1, [&] {
+        conn->buffer.send(static_cast<const uint8_t *>(data), length);
+        return 0;
+    });
+}
+
+int rdmamsg_send_more(rdmamsg_conn *conn, const void *data, size_t length) {
+    if (rejectEmpty(length)) {
+        return -1;
+    }
+    return guarded(-1, [&] {
+        conn->buffer.stage(static_cast<const uint8_t *>(data), length);
+        return 0;
+    });
+}
+
+int rdmamsg_flush(rdmamsg_conn *conn) {
+    return guarded(-1, [&] {
+        conn->buffer.flush();
+        return 0;
+    });
+}
+
+ssize_t rdmamsg_recv(rdmamsg_conn *conn, void *buffer, size_t max_size) {
+    return guarded<ssize_t>(-1, [&] {
+        releasePeeked(conn);
+        return static_cast<ssize_t>(conn->buffer.receive(buffer, max_size));
+    });
+}
+
+ssize_t rdmamsg_recv_zc(rdmamsg_conn *conn, const void **data) {
+    return guarded<ssize_t>(-1, [&] {
+        releasePeeked(conn);
+        const uint8_t *message;
+        size_t length;
+        if (conn->buffer.peek(message, length)) {
+            conn->peeked = message != nullptr;
+            *data = message;
+            return static_cast<ssize_t>(length);
+        }
+        conn->scratch = conn->buffer.receive();
+        *data = conn->scratch.data();
+        return static_cast<ssize_t>(conn->scratch.size());
+    });
+}
+
+void rdmamsg_recv_done(rdmamsg_conn *conn) {
+    releasePeeked(conn);
+}
+
+int rdmamsg_poll(rdmamsg_pollconn *conns, size_t count, int timeout_ms) {
+    const auto start = chrono::steady_clock::now();
+    for (;;) {
+        int ready = 0;
+        for (size_t i = 0; i < count; ++i) {
+            auto &conn = conns[i];
+            conn.revents = 0;
+            try {
+                conn.conn->buffer.checkConnection();
+            } catch (const NetworkException &) {
+                conn.revents |= RDMAMSG_POLLERR;
+            }
+            if (not conn.conn->peeked && conn.conn->buffer.hasData()) {
+                conn.revents |= conn.events & RDMAMSG_POLLIN;
+            }
+            if (conn.conn->buffer.remoteShutdown()) {
+                conn.revents |= RDMAMSG_POLLHUP;
+            }
+            if (conn.revents != 0) {
+                ++ready;
+            }
+        }
+        if (ready > 0 || (timeout_ms >= 0 && chrono::steady_clock::now() - start >= chrono::milliseconds(timeout_ms))) {
+            return ready;
+        }
+    }
+}
+
+int rdmamsg_shutdown(rdmamsg_conn *conn) {
+    return guarded(-1, [&] {
+        conn->buffer.shutdown();
+        return 0;
+    });
+}
+
+void rdmamsg_close(rdmamsg_conn *conn) {
+    guarded(0, [&] {
+        releasePeeked(conn);
+        conn->buffer.close();
+        return 0;
+    });
+    delete conn;
+}
@@ -0,0 +1,78 @@
+#ifndef RDMA_HASH_MAP_RDMAMSG_H
+#define RDMA_HASH_MAP_RDMAMSG_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/// C interface of the RDMAMessageBuffer, for programs which want to use RDMA messaging directly instead of through the
+/// preload library. Connections are message oriented: every rdmamsg_send() is received as one message.
+/// Functions return -1 and set errno on errors: EIO if the connection broke, EINVAL for messages which don't fit into
+/// the ring or the receive buffer, or which are empty, and ENOMEM if memory couldn't be allocated.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#pragma GCC visibility push(default)
+
+/// Incremented on incompatible changes of this interface
+#define RDMAMSG_ABI_VERSION 1
+
+#define RDMAMSG_POLLIN 0x1
+#define RDMAMSG_POLLHUP 0x2
+#define RDMAMSG_POLLERR 0x4
+
+typedef struct rdmamsg_conn rdmamsg_conn;
+
+typedef struct rdmamsg_pollconn {
+    rdmamsg_conn *conn;
+    /// RDMAMSG_POLLIN: a message or the end of the stream can be received without blocking
+    short events;
+    /// Additionally RDMAMSG_POLLHUP after the remote side shut down and RDMAMSG_POLLERR if the connection broke
+    short revents;
+} rdmamsg_pollconn;
+
+/// The RDMAMSG_ABI_VERSION the library was built with
+int rdmamsg_abi_version(void);
+
+/// Set up an RDMA connection, exchanging the connection info over a connected TCP socket. Both sides need the same
+/// buffer_size, which must be a power of 2. Messages bigger than 64KB are striped over the given number of queue pairs,
+/// both sides use the smaller stripe count. Returns NULL on errors
+rdmamsg_conn *rdmamsg_connect_fd(int fd, size_t buffer_size, size_t stripes);
+
+/// Send a message, blocks until there is space in the remote ring
+int rdmamsg_send(rdmamsg_conn *conn, const void *data, size_t length);
+
+/// Copy a message to the send ring, without writing it to the remote side yet. Many small messages are written with
+/// a single work request by the next rdmamsg_flush() or rdmamsg_send()
+int rdmamsg_send_more(rdmamsg_conn *conn, const void *data, size_t length);
+
+int rdmamsg_flush(rdmamsg_conn *conn);
+
+/// Receive the next message into buffer, blocks until it is there. Returns its length, 0 after the remote side shut
+/// down and all of its messages were received
+ssize_t rdmamsg_recv(rdmamsg_conn *conn, void *buffer, size_t max_size);
+
+/// Zero copy receive: Like rdmamsg_recv(), but points data to the message in the receive ring. It stays valid until
+/// rdmamsg_recv_done() or the next receive. Messages not stored in one piece are copied to a buffer of the connection
+ssize_t rdmamsg_recv_zc(rdmamsg_conn *conn, const void **data);
+
+/// Free the message of rdmamsg_recv_zc(), so the remote side can reuse its space. rdmamsg_poll() only looks at the
+/// messages after it, once it is freed
+void rdmamsg_recv_done(rdmamsg_conn *conn);
+
+/// Wait up to timeout_ms milliseconds (-1 for no limit) until any of the connections has events. Returns the number of
+/// connections with events, like poll()
+int rdmamsg_poll(rdmamsg_pollconn *conns, size_t count, int timeout_ms);
+
+/// Tell the remote side, that no more messages follow. Receiving is still possible
+int rdmamsg_shutdown(rdmamsg_conn *conn);
+
+/// Close the connection (bounded, see RDMAMessageBuffer::close()) and free it. The socket stays open
+void rdmamsg_close(rdmamsg_conn *conn);
+
+#pragma GCC visibility pop
+#ifdef __cplusplus
+}
+#endif
+
+#endif //RDMA_HASH_MAP_RDMAMSG_H